@@ -0,0 +1,164 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "ae.h"
+
+/* Distance between samples, in pixels, must be even. */
+#define AE_STEP 8
+/* Limits, exposure is kept short enough for live video before using
+ * gain. */
+#define AE_EXPOSURE_MIN 1.0
+#define AE_EXPOSURE_MAX 200.0
+#define AE_GAIN_MIN 0.33
+#define AE_GAIN_MAX 42.66
+/* Level is on target within this ratio, and goes off target beyond the
+ * larger one, to avoid oscillation. */
+#define AE_TOLERANCE 0.05
+#define AE_HYSTERESIS 0.15
+
+void
+ae_init(struct ae *ae, double target, double percentile, double exposure,
+	double gain)
+{
+    ae->target = target;
+    ae->percentile = percentile;
+    ae->exposure = exposure;
+    ae->gain = gain;
+    ae->started = false;
+    ae->converged = false;
+    ae->start_sequence = 0;
+    memset(&ae->stats, 0, sizeof(ae->stats));
+}
+
+int
+ae_histogram(const uint8_t *bayer, int width, int height,
+	uint32_t hist[256])
+{
+    int n = 0;
+    memset(hist, 0, 256 * sizeof(*hist));
+    for (int y = 0; y + 1 < height; y += AE_STEP) {
+	const uint8_t *row = bayer + y * width;
+	for (int x = 0; x + 1 < width; x += AE_STEP, n++) {
+	    /* One sample of each color. */
+	    int l = (row[x] + row[x + 1] + row[x + width] + row[x + width + 1])
+		>> 2;
+	    hist[l]++;
+	}
+    }
+    return n;
+}
+
+/* Measure image level, mean or percentile. */
+static double
+ae_measure(struct ae *ae, const uint32_t hist[256], int n)
+{
+    if (ae->percentile) {
+	uint32_t limit = n * ae->percentile / 100.0;
+	uint32_t sum = 0;
+	for (int i = 0; i < 256; i++) {
+	    sum += hist[i];
+	    if (sum > limit)
+		return i;
+	}
+	return 255;
+    } else {
+	uint64_t sum = 0;
+	for (int i = 0; i < 256; i++)
+	    sum += (uint64_t) hist[i] * i;
+	return (double) sum / n;
+    }
+}
+
+/* Share the requested amount of light between exposure and gain. */
+static void
+ae_set(struct ae *ae, double light)
+{
+    double exposure = light;
+    double gain = 1.0;
+    if (exposure > AE_EXPOSURE_MAX) {
+	exposure = AE_EXPOSURE_MAX;
+	gain = fmin(light / exposure, AE_GAIN_MAX);
+    } else if (exposure < AE_EXPOSURE_MIN) {
+	exposure = AE_EXPOSURE_MIN;
+	gain = fmax(light / exposure, AE_GAIN_MIN);
+    }
+    ae->exposure = exposure;
+    ae->gain = gain;
+}
+
+static bool
+ae_control(struct ae *ae, const struct frame *frame, int width, int height)
+{
+    /* Only use frames taken with the last settings. */
+    if ((frame->flags & FRAME_SETTLING) || frame->exposure != ae->exposure
+	    || frame->gain != ae->gain)
+	return false;
+    uint32_t hist[256];
+    int n = ae_histogram(frame->data, width, height, hist);
+    double level = fmax(ae_measure(ae, hist, n), 1.0);
+    double error = fabs(log(level / ae->target));
+    if (!ae->started) {
+	ae->started = true;
+	ae->start_sequence = frame->sequence;
+    }
+    if (ae->converged) {
+	if (error < log(1.0 + AE_HYSTERESIS))
+	    return false;
+	ae->converged = false;
+	ae->start_sequence = frame->sequence;
+    } else if (error < log(1.0 + AE_TOLERANCE)) {
+	int frames = frame->sequence - ae->start_sequence;
+	ae->converged = true;
+	ae->stats.converges++;
+	ae->stats.converge_frames_sum += frames;
+	if (frames > ae->stats.converge_frames_max)
+	    ae->stats.converge_frames_max = frames;
+	return false;
+    }
+    /* Sensor is linear, but saturated pixels make it look less so, do not
+     * go all the way. */
+    double ratio = pow(ae->target / level, 0.8);
+    double exposure = ae->exposure;
+    double gain = ae->gain;
+    ae_set(ae, exposure * gain * ratio);
+    return ae->exposure != exposure || ae->gain != gain;
+}
+
+bool
+ae_update(struct ae *ae, const struct frame *frame, int width, int height)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    bool changed = ae_control(ae, frame, width, height);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    double cpu = (end.tv_sec - start.tv_sec)
+	+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+    ae->stats.frames++;
+    ae->stats.cpu_sum += cpu;
+    if (cpu > ae->stats.cpu_max)
+	ae->stats.cpu_max = cpu;
+    return changed;
+}
@@ -0,0 +1,84 @@
+#ifndef ae_h
+#define ae_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+/* Auto-exposure controller.
+ *
+ * A luminance histogram is built from a sample of the raw Bayer image, one
+ * 2x2 cell every few pixels, which is enough to measure the image level
+ * at a small fraction of the cost of a full pass.  Exposure, then gain,
+ * are changed to bring the mean or a percentile of the histogram to the
+ * target level.  Frames received before the previous change took effect
+ * are ignored. */
+
+/* Auto-exposure statistics. */
+struct ae_stats {
+    /* Number of processed frames, and CPU time used, in seconds. */
+    int frames;
+    double cpu_sum;
+    double cpu_max;
+    /* Number of times the target was reached, and sum and maximum of the
+     * number of frames needed. */
+    int converges;
+    int converge_frames_sum;
+    int converge_frames_max;
+};
+
+struct ae {
+    /* Target level, for the mean, or for the given percentile if not 0. */
+    double target;
+    double percentile;
+    /* Current settings. */
+    double exposure;
+    double gain;
+    /* True once the first frame is seen. */
+    bool started;
+    /* True when the level is on target. */
+    bool converged;
+    /* Sequence number of the frame when the level went off target. */
+    uint32_t start_sequence;
+    struct ae_stats stats;
+};
+
+/* Initialise controller, with the current device settings. */
+void
+ae_init(struct ae *ae, double target, double percentile, double exposure,
+	double gain);
+
+/* Build a luminance histogram from a sample of a GRBG Bayer image, return
+ * the number of samples. */
+int
+ae_histogram(const uint8_t *bayer, int width, int height,
+	uint32_t hist[256]);
+
+/* Process a frame, return true if settings were changed and should be sent
+ * to the device. */
+bool
+ae_update(struct ae *ae, const struct frame *frame, int width, int height);
+
+#endif /* ae_h */
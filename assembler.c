@@ -0,0 +1,130 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <string.h>
+
+#include "assembler.h"
+
+void
+assembler_init(struct assembler *assembler, int image_size)
+{
+    assembler->image_size = image_size;
+    assembler->pending = NULL;
+    assembler->locked = false;
+    assembler->resync = false;
+    assembler->sequence = 0;
+    assembler->short_ = 0;
+    assembler->long_ = 0;
+    assembler->stitched = 0;
+}
+
+/* Return a complete image. */
+static struct frame *
+assembler_complete(struct assembler *assembler, struct frame *frame,
+	int flags)
+{
+    frame->length = assembler->image_size;
+    frame->sequence = assembler->sequence++;
+    frame->flags = flags;
+    if (assembler->resync) {
+	frame->flags |= FRAME_RESYNC;
+	assembler->resync = false;
+    }
+    return frame;
+}
+
+/* Throw away an image of the given length. */
+static void
+assembler_discard(struct assembler *assembler, struct frame *frame,
+	int length)
+{
+    if (length < assembler->image_size)
+	assembler->short_++;
+    else
+	assembler->long_++;
+    assembler->sequence++;
+    assembler->resync = true;
+    frame_unref(frame);
+}
+
+struct frame *
+assembler_push(struct assembler *assembler, struct frame *frame,
+	int length, bool end)
+{
+    struct frame *pending = assembler->pending;
+    if (pending) {
+	/* Continue a partial image. */
+	if (pending->length + length > assembler->image_size) {
+	    assembler->pending = NULL;
+	    assembler_discard(assembler, pending, pending->length + length);
+	    frame_unref(frame);
+	    assembler->locked = end;
+	    return NULL;
+	}
+	memcpy(pending->data + pending->length, frame->data, length);
+	pending->length += length;
+	frame_unref(frame);
+	if (!end)
+	    return NULL;
+	assembler->pending = NULL;
+	assembler->locked = true;
+	if (pending->length == assembler->image_size) {
+	    assembler->stitched++;
+	    return assembler_complete(assembler, pending, FRAME_STITCHED);
+	}
+	assembler_discard(assembler, pending, pending->length);
+	return NULL;
+    } else if (end) {
+	/* Transfer ends on an image boundary.  A whole image is accepted
+	 * even if its start was not known to be on a boundary. */
+	assembler->locked = true;
+	if (length == assembler->image_size)
+	    return assembler_complete(assembler, frame, 0);
+	assembler_discard(assembler, frame, length);
+	return NULL;
+    } else if (assembler->locked && length <= assembler->image_size) {
+	/* Start of an image, wait for the rest. */
+	frame->length = length;
+	assembler->pending = frame;
+	return NULL;
+    } else {
+	/* No way to know where this data belongs, wait for the next
+	 * boundary. */
+	if (length > assembler->image_size)
+	    assembler->long_++;
+	assembler->locked = false;
+	assembler->resync = true;
+	frame_unref(frame);
+	return NULL;
+    }
+}
+
+void
+assembler_reset(struct assembler *assembler)
+{
+    if (assembler->pending) {
+	frame_unref(assembler->pending);
+	assembler->pending = NULL;
+    }
+    assembler->locked = false;
+    assembler->resync = true;
+}
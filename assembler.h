@@ -0,0 +1,72 @@
+#ifndef assembler_h
+#define assembler_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdbool.h>
+
+#include "pool.h"
+
+/* Frame assembler.
+ *
+ * The camera ends each image with a short or zero length packet, which
+ * terminates the bulk transfer.  The assembler is fed with the content of
+ * each transfer and whether it was terminated this way.  It stitches
+ * images split over several transfers and throws away data which can not
+ * be part of a complete image, until the next image boundary.
+ *
+ * It does not depend on libusb, so that it can be fed from any source. */
+struct assembler {
+    int image_size;
+    /* Partial image, starting on an image boundary. */
+    struct frame *pending;
+    /* True when the next received byte is known to start an image. */
+    bool locked;
+    /* Next assembled frame is the first one after discarded data. */
+    bool resync;
+    /* Number of image boundaries seen, used as sequence number. */
+    uint32_t sequence;
+    /* Number of images discarded because too short or too long. */
+    int short_;
+    int long_;
+    /* Number of images received in several transfers. */
+    int stitched;
+};
+
+/* Initialise assembler state. */
+void
+assembler_init(struct assembler *assembler, int image_size);
+
+/* Feed a transfer.  The transfer frame reference is given to the
+ * assembler, it may be kept, returned or given back to the pool.  When an
+ * image is complete, return its frame, with length, sequence and flags
+ * filled, else NULL.  The end parameter tells whether the transfer was
+ * terminated by a short or zero length packet. */
+struct frame *
+assembler_push(struct assembler *assembler, struct frame *frame,
+	int length, bool end);
+
+/* Drop any partial image, to be called when the stream is interrupted. */
+void
+assembler_reset(struct assembler *assembler);
+
+#endif /* assembler_h */
@@ -0,0 +1,834 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "demosaic.h"
+#include "encoder.h"
+#include "replay.h"
+#include "workers.h"
+
+/* Minimum time spent measuring each case, in seconds. */
+#define BENCH_TIME 0.5
+
+static const struct {
+    int width;
+    int height;
+} sizes[] = {
+    { 512, 384 },
+    { 1024, 768 },
+    { 2048, 1536 },
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Padding added to lines when checking that the pitch is respected. */
+#define BENCH_PADDING 64
+
+static const char *orientations[DEMOSAIC_ORIENTATIONS_NB] = {
+    "0", "90", "180", "270", "0m", "90m", "180m", "270m" };
+
+/* Output position of input pixel x, y. */
+static void
+bench_orient(enum demosaic_orientation orientation, int width, int height,
+	int x, int y, int *ox, int *oy)
+{
+    if (orientation & DEMOSAIC_MIRROR)
+	x = width - 1 - x;
+    switch (orientation & 3) {
+    case DEMOSAIC_ROTATE_0:
+	*ox = x;
+	*oy = y;
+	break;
+    case DEMOSAIC_ROTATE_90:
+	*ox = height - 1 - y;
+	*oy = x;
+	break;
+    case DEMOSAIC_ROTATE_180:
+	*ox = width - 1 - x;
+	*oy = height - 1 - y;
+	break;
+    default:
+	*ox = y;
+	*oy = width - 1 - x;
+	break;
+    }
+}
+
+static const char *formats[] = { "bgra32", "bgr24", "planar", "gray" };
+
+#define BENCH_FORMATS_NB 4
+
+/* Convert a BGRA pixel to another format. */
+static void
+bench_put(uint8_t *o, enum demosaic_format format, int plane,
+	const uint8_t *bgra)
+{
+    switch (format) {
+    case DEMOSAIC_BGRA32:
+	memcpy(o, bgra, 4);
+	break;
+    case DEMOSAIC_BGR24:
+	memcpy(o, bgra, 3);
+	break;
+    case DEMOSAIC_PLANAR:
+	o[0] = bgra[2];
+	o[plane] = bgra[1];
+	o[2 * plane] = bgra[0];
+	break;
+    case DEMOSAIC_GRAY:
+	o[0] = (29 * bgra[0] + 150 * bgra[1] + 77 * bgra[2] + 128) >> 8;
+	break;
+    }
+}
+
+/* Size of an output image. */
+static int
+bench_size(int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format)
+{
+    int out_width, out_height;
+    demosaic_output_size(orientation, width, height, &out_width,
+	    &out_height);
+    int plane = pitch * out_height;
+    return format == DEMOSAIC_PLANAR ? 3 * plane : plane;
+}
+
+/* Make the expected output from the BGRA reference output, with the given
+ * pitch, orientation and format, to be freed by the caller.  Padding is
+ * left to zero. */
+static uint8_t *
+bench_expected(const uint8_t *ref, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format)
+{
+    int out_width, out_height;
+    demosaic_output_size(orientation, width, height, &out_width,
+	    &out_height);
+    int bpp = demosaic_bytes_per_pixel(format);
+    int plane = pitch * out_height;
+    uint8_t *expected = calloc(bench_size(pitch, width, height, orientation,
+		format), 1);
+    if (!expected)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    int ox, oy;
+	    bench_orient(orientation, width, height, x, y, &ox, &oy);
+	    bench_put(expected + oy * pitch + ox * bpp, format, plane,
+		    ref + (y * width + x) * 4);
+	}
+    }
+    return expected;
+}
+
+/* Check an implementation against the expected output, with the given
+ * pitch, orientation and format, return false on mismatch.  Without
+ * workers, the whole image function is used, it only writes BGRA without
+ * rotation.  Padding must be left untouched. */
+static bool
+bench_check(const struct demosaic_variant *variant, struct workers *workers,
+	const uint8_t *bayer, const uint8_t *expected, uint8_t *rgb,
+	int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format)
+{
+    int out_height = orientation & 1 ? width : height;
+    int bpp = demosaic_bytes_per_pixel(format);
+    int plane = pitch * out_height;
+    int size = bench_size(pitch, width, height, orientation, format);
+    memset(rgb, 0, size);
+    if (workers)
+	demosaic_run(workers, variant, bayer, rgb, pitch, width, height,
+		orientation, format);
+    else
+	variant->fn(bayer, rgb, pitch, width, height);
+    /* Compare bytes one by one only to locate a mismatch. */
+    bool same = memcmp(rgb, expected, size) == 0;
+    for (int i = 0; !same; i++) {
+	if (rgb[i] != expected[i]) {
+	    fprintf(stderr, "%s: %dx%d pitch %d rotate %s %s: mismatch at"
+		    " x=%d y=%d byte %d: %d instead of %d\n", variant->name,
+		    width, height, pitch, orientations[orientation],
+		    formats[format], i % pitch / bpp, i % plane / pitch,
+		    i % pitch % bpp + i / plane, rgb[i], expected[i]);
+	    break;
+	}
+    }
+    return same;
+}
+
+/* Result of a measure, from the time of each conversion. */
+struct bench_time {
+    /* Mean throughput, in megapixels per second. */
+    double mpix;
+    /* Mean time per pixel, in nanoseconds. */
+    double ns;
+    /* Standard deviation from one conversion to another, relative to the
+     * mean. */
+    double deviation;
+};
+
+/* Measure conversions, using workers if not NULL, else the whole image
+ * function which ignores orientation and format. */
+static void
+bench_run(const struct demosaic_variant *variant, struct workers *workers,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	struct bench_time *result)
+{
+    int iterations = 0;
+    double sum = 0.0, sum2 = 0.0;
+    double start = now();
+    double end = start;
+    do {
+	double t = end;
+	if (workers)
+	    demosaic_run(workers, variant, bayer, rgb, pitch, width, height,
+		    orientation, format);
+	else
+	    variant->fn(bayer, rgb, pitch, width, height);
+	end = now();
+	sum += end - t;
+	sum2 += (end - t) * (end - t);
+	iterations++;
+    } while (end - start < BENCH_TIME);
+    double mean = sum / iterations;
+    double variance = iterations > 1
+	? (sum2 - sum * mean) / (iterations - 1) : 0.0;
+    result->mpix = width * height / mean * 1e-6;
+    result->ns = mean / width / height * 1e9;
+    result->deviation = variance > 0.0 ? sqrt(variance) / mean : 0.0;
+}
+
+/* Print the start of a result line. */
+static void
+bench_print(const char *method, const char *variant, int width, int height,
+	const struct bench_time *result)
+{
+    printf("%-8s %-10s %4dx%-4d %7.1f MPix/s %6.3f ns/pixel %5.1f%% sd",
+	    method, variant, width, height, result->mpix, result->ns,
+	    result->deviation * 100.0);
+}
+
+/* Hardware cache counters, when the kernel lets us use them. */
+enum bench_counter {
+    BENCH_L1D_MISSES,
+    BENCH_LLC_MISSES,
+    BENCH_COUNTERS_NB
+};
+
+static int counters[BENCH_COUNTERS_NB] = { -1, -1 };
+
+/* Open counters for the calling thread, which runs single worker jobs. */
+static void
+bench_counters_open(void)
+{
+    static const struct {
+	uint32_t type;
+	uint64_t config;
+    } events[BENCH_COUNTERS_NB] = {
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+	    | PERF_COUNT_HW_CACHE_OP_READ << 8
+	    | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    };
+    for (int i = 0; i < BENCH_COUNTERS_NB; i++) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	counters[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (counters[BENCH_L1D_MISSES] < 0 && counters[BENCH_LLC_MISSES] < 0)
+	printf("no hardware counters, cache misses not measured\n");
+}
+
+/* Measure cache misses per pixel over a few conversions on a single
+ * worker, set to -1 when not available. */
+static void
+bench_misses(const struct demosaic_variant *variant, struct workers *workers,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	double misses[BENCH_COUNTERS_NB])
+{
+    const int iterations = 8;
+    for (int i = 0; i < BENCH_COUNTERS_NB; i++) {
+	if (counters[i] >= 0) {
+	    ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+    for (int i = 0; i < iterations; i++)
+	demosaic_run(workers, variant, bayer, rgb, pitch, width, height,
+		orientation, format);
+    for (int i = 0; i < BENCH_COUNTERS_NB; i++) {
+	uint64_t count;
+	misses[i] = -1.0;
+	if (counters[i] >= 0) {
+	    ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+	    if (read(counters[i], &count, sizeof(count)) == sizeof(count))
+		misses[i] = (double) count / iterations / width / height;
+	}
+    }
+}
+
+static const char *methods[DEMOSAIC_METHODS_NB] = { "bilinear", "mhc" };
+
+/* Check and, if measure is true, measure all implementations of a
+ * method, return false on mismatch. */
+static bool
+bench_method(enum demosaic_method method, const uint8_t *bayer,
+	uint8_t *ref, uint8_t *rgb, int width, int height, int cpus,
+	bool measure)
+{
+    int variants_nb;
+    const struct demosaic_variant *variants = demosaic_variants(method,
+	    &variants_nb);
+    const struct demosaic_variant *best = &variants[variants_nb - 1];
+    bool ok = true;
+    variants[0].fn(bayer, ref, width * 4, width, height);
+    uint8_t *padded = bench_expected(ref, width * 4 + BENCH_PADDING, width,
+	    height, DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32);
+    for (int j = 0; j < variants_nb; j++) {
+	const struct demosaic_variant *variant = &variants[j];
+	bool same = bench_check(variant, NULL, bayer, ref, rgb, width * 4,
+		width, height, DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32)
+	    && bench_check(variant, NULL, bayer, padded, rgb,
+		    width * 4 + BENCH_PADDING, width, height,
+		    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32);
+	ok = ok && same;
+	if (!measure)
+	    continue;
+	struct bench_time result;
+	bench_run(variant, NULL, bayer, rgb, width * 4, width, height,
+		DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, &result);
+	bench_print(methods[method], variant->name, width, height, &result);
+	printf("%s\n", same ? "" : "  MISMATCH");
+    }
+    free(padded);
+    /* Scaling with the number of threads, up to the number of CPU and at
+     * least two to check band limits. */
+    double mpix_1 = 0.0;
+    for (int threads = 1; threads <= cpus || threads <= 2; threads *= 2) {
+	struct workers *workers = workers_new(threads);
+	memset(rgb, 0, width * height * 4);
+	demosaic_run(workers, best, bayer, rgb, width * 4, width, height,
+		DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32);
+	bool same = memcmp(rgb, ref, width * height * 4) == 0;
+	ok = ok && same;
+	if (measure) {
+	    struct bench_time result;
+	    bench_run(best, workers, bayer, rgb, width * 4, width, height,
+		    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, &result);
+	    if (threads == 1)
+		mpix_1 = result.mpix;
+	    bench_print(methods[method], best->name, width, height,
+		    &result);
+	    printf(", %2d threads, speedup %.2f%s\n", threads,
+		    result.mpix / mpix_1, same ? "" : "  MISMATCH");
+	}
+	workers_free(workers);
+    }
+    /* Every orientation and format, in two bands to cross a band limit,
+     * then the cost of rotations and formats on a single thread. */
+    struct workers *workers = workers_new(2);
+    bool same[DEMOSAIC_ORIENTATIONS_NB][BENCH_FORMATS_NB];
+    for (int o = 0; o < DEMOSAIC_ORIENTATIONS_NB; o++) {
+	for (int f = 0; f < BENCH_FORMATS_NB; f++) {
+	    int out_width, out_height;
+	    demosaic_output_size(o, width, height, &out_width, &out_height);
+	    int pitch = out_width * demosaic_bytes_per_pixel(f)
+		+ BENCH_PADDING;
+	    uint8_t *expected = bench_expected(ref, pitch, width, height, o,
+		    f);
+	    same[o][f] = true;
+	    for (int j = 0; j < variants_nb; j++)
+		same[o][f] = bench_check(&variants[j], workers, bayer,
+			expected, rgb, pitch, width, height, o, f)
+		    && same[o][f];
+	    ok = ok && same[o][f];
+	    free(expected);
+	}
+    }
+    workers_free(workers);
+    if (!measure)
+	return ok;
+    /* Rotations, for the best implementation, and a quarter turn for all
+     * of them to compare line streaming with tiling. */
+    workers = workers_new(1);
+    for (int j = 0; j < variants_nb; j++) {
+	const struct demosaic_variant *variant = &variants[j];
+	for (int o = DEMOSAIC_ROTATE_0; o <= DEMOSAIC_ROTATE_270; o++) {
+	    if (variant != best && o != DEMOSAIC_ROTATE_90)
+		continue;
+	    int out_width, out_height;
+	    demosaic_output_size(o, width, height, &out_width, &out_height);
+	    struct bench_time result;
+	    bench_run(variant, workers, bayer, rgb, out_width * 4, width,
+		    height, o, DEMOSAIC_BGRA32, &result);
+	    double misses[BENCH_COUNTERS_NB];
+	    bench_misses(variant, workers, bayer, rgb, out_width * 4, width,
+		    height, o, DEMOSAIC_BGRA32, misses);
+	    bool all = true;
+	    for (int f = 0; f < BENCH_FORMATS_NB; f++)
+		all = all && same[o][f] && same[o | DEMOSAIC_MIRROR][f];
+	    bench_print(methods[method], variant->name, width, height,
+		    &result);
+	    printf(", rotate %s", orientations[o]);
+	    if (misses[BENCH_L1D_MISSES] >= 0.0)
+		printf(", L1D %.3f", misses[BENCH_L1D_MISSES]);
+	    if (misses[BENCH_LLC_MISSES] >= 0.0)
+		printf(", LLC %.3f", misses[BENCH_LLC_MISSES]);
+	    if (misses[BENCH_L1D_MISSES] >= 0.0
+		    || misses[BENCH_LLC_MISSES] >= 0.0)
+		printf(" misses/pixel");
+	    printf("%s\n", all ? "" : "  MISMATCH");
+	}
+    }
+    for (int f = 0; f < BENCH_FORMATS_NB; f++) {
+	int pitch = width * demosaic_bytes_per_pixel(f);
+	int bytes = pitch * height * (f == DEMOSAIC_PLANAR ? 3 : 1);
+	struct bench_time result;
+	bench_run(best, workers, bayer, rgb, pitch, width, height,
+		DEMOSAIC_ROTATE_0, f, &result);
+	bench_print(methods[method], best->name, width, height, &result);
+	printf(", %-6s %8d bytes/frame, %6.3f ms/frame\n", formats[f], bytes,
+		width * height / result.mpix * 1e-3);
+    }
+    workers_free(workers);
+    return ok;
+}
+
+/* Check conversion of a few lines at a time, as done when streaming
+ * images to PNG files, against conversion of whole images, return false on
+ * mismatch.  Images are also cropped by two lines, so that their height is
+ * not a multiple of ENCODER_LINES. */
+static bool
+bench_stream(enum demosaic_method method, const uint8_t *bayer, int width,
+	int height)
+{
+    static const enum demosaic_orientation stream_orientations[] = {
+	DEMOSAIC_ROTATE_0, DEMOSAIC_ROTATE_180, DEMOSAIC_MIRROR,
+	DEMOSAIC_ROTATE_180 | DEMOSAIC_MIRROR };
+    static const enum demosaic_format stream_formats[] = {
+	DEMOSAIC_BGR24, DEMOSAIC_GRAY };
+    struct workers *workers = workers_new(2);
+    uint8_t *image = malloc(width * 3 * height);
+    uint8_t *lines = malloc(width * 3 * ENCODER_LINES);
+    if (!image || !lines)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    bool ok = true;
+    for (int h = height; h >= height - 2; h -= 2) {
+	for (size_t i = 0; i < sizeof(stream_orientations)
+		/ sizeof(stream_orientations[0]); i++) {
+	    for (size_t j = 0; j < sizeof(stream_formats)
+		    / sizeof(stream_formats[0]); j++) {
+		enum demosaic_orientation o = stream_orientations[i];
+		enum demosaic_format f = stream_formats[j];
+		int pitch = width * demosaic_bytes_per_pixel(f);
+		demosaic_convert(workers, method, bayer, image, pitch, width,
+			h, o, f);
+		for (int y = 0; y < h; y += ENCODER_LINES) {
+		    int n = h - y < ENCODER_LINES ? h - y : ENCODER_LINES;
+		    int y0 = o & DEMOSAIC_ROTATE_180 ? h - y - n : y;
+		    demosaic_convert_lines(workers, method, bayer, lines,
+			    pitch, width, h, o, f, y0, y0 + n);
+		    if (memcmp(lines, image + y * pitch, n * pitch)) {
+			fprintf(stderr, "%s: %dx%d rotate %s %s: streamed"
+				" lines %d to %d differ\n", methods[method],
+				width, h, orientations[o], formats[f], y,
+				y + n - 1);
+			ok = false;
+			break;
+		    }
+		}
+	    }
+	}
+    }
+    free(image);
+    free(lines);
+    workers_free(workers);
+    return ok;
+}
+
+/* Preview, as a whole image function. */
+static void
+bench_superpixel(const uint8_t *bayer, uint8_t *rgb, int pitch, int width,
+	int height)
+{
+    demosaic_superpixel(bayer, rgb, pitch, width, height, DEMOSAIC_ROTATE_0,
+	    DEMOSAIC_BGRA32);
+}
+
+/* Synthetic test images. */
+enum bench_pattern {
+    /* Smooth color gradients. */
+    BENCH_GRADIENT,
+    /* Blocks of random colors, with sharp edges. */
+    BENCH_BLOCKS,
+    /* Zone plate, with increasing frequency. */
+    BENCH_ZONE,
+    BENCH_PATTERNS_NB
+};
+
+static const char *patterns[BENCH_PATTERNS_NB] = {
+    "gradient", "blocks", "zone" };
+
+/* Draw a BGRA test image. */
+static void
+bench_pattern(enum bench_pattern pattern, uint8_t *bgra, int width,
+	int height)
+{
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    uint8_t *o = bgra + (y * width + x) * 4;
+	    if (pattern == BENCH_GRADIENT) {
+		o[0] = x * 255 / width;
+		o[1] = y * 255 / height;
+		o[2] = (x + y) * 255 / (width + height);
+	    } else if (pattern == BENCH_BLOCKS) {
+		/* Like natural images, colors are correlated. */
+		unsigned seed = (y / 23) * 1000 + x / 23;
+		int l = 40 + rand_r(&seed) % 176;
+		o[0] = l + rand_r(&seed) % 81 - 40;
+		o[1] = l;
+		o[2] = l + rand_r(&seed) % 81 - 40;
+	    } else {
+		double dx = x - width / 2, dy = y - height / 2;
+		double v = 127.5 + 127.0 * cos(M_PI * (dx * dx + dy * dy)
+			/ (width * 2.0));
+		o[0] = v * 0.8;
+		o[1] = v;
+		o[2] = v * 0.9;
+	    }
+	    o[3] = 255;
+	}
+    }
+}
+
+/* Keep one color per pixel, using the GRBG pattern of the sensor. */
+static void
+bench_mosaic(const uint8_t *bgra, uint8_t *bayer, int width, int height)
+{
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    const uint8_t *p = bgra + (y * width + x) * 4;
+	    int channel = y & 1 ? (x & 1 ? 1 : 0) : (x & 1 ? 2 : 1);
+	    bayer[y * width + x] = p[channel];
+	}
+    }
+}
+
+/* Peak signal to noise ratio of color channels in dB, borders excluded. */
+static double
+bench_psnr(const uint8_t *a, const uint8_t *b, int width, int height)
+{
+    double sum = 0.0;
+    int n = 0;
+    for (int y = 2; y < height - 2; y++) {
+	for (int x = 2; x < width - 2; x++) {
+	    for (int c = 0; c < 3; c++) {
+		int i = (y * width + x) * 4 + c;
+		int d = a[i] - b[i];
+		sum += d * d;
+		n++;
+	    }
+	}
+    }
+    return sum ? 10.0 * log10(255.0 * 255.0 * n / sum) : INFINITY;
+}
+
+static const char *profiles[ENCODER_PROFILES_NB] = {
+    "fast", "balanced", "small" };
+
+/* Measure PNG compression of a frame with each profile. */
+static void
+bench_png(const char *source, const uint8_t *bayer, int width, int height)
+{
+    struct workers *workers = workers_new(1);
+    uint8_t *rgb = malloc(width * height * 3);
+    FILE *file = tmpfile();
+    if (!rgb)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    if (!file)
+	error(EXIT_FAILURE, errno, "can not create temporary file");
+    demosaic_convert(workers, DEMOSAIC_BILINEAR, bayer, rgb, width * 3,
+	    width, height, DEMOSAIC_ROTATE_0, DEMOSAIC_BGR24);
+    for (int p = 0; p < ENCODER_PROFILES_NB; p++) {
+	int iterations = 0;
+	long size;
+	double start = now();
+	double elapsed;
+	do {
+	    rewind(file);
+	    encoder_write_png(file, "temporary file", rgb, width * 3, width,
+		    height, DEMOSAIC_BGR24, p);
+	    if (fflush(file))
+		error(EXIT_FAILURE, errno, "can not write temporary file");
+	    size = ftell(file);
+	    iterations++;
+	    elapsed = now() - start;
+	} while (elapsed < BENCH_TIME);
+	printf("%-8s %-10s %4dx%-4d %7.1f ms/frame %9ld bytes/frame"
+		" %5.2f bits/pixel, %s\n", "png", profiles[p], width, height,
+		elapsed / iterations * 1e3, size,
+		size * 8.0 / width / height, source);
+    }
+    fclose(file);
+    free(rgb);
+    workers_free(workers);
+}
+
+/* Check and, if measure is true, measure all methods on a frame, return
+ * false on mismatch. */
+static bool
+bench_frame(const char *source, const uint8_t *bayer, int width, int height,
+	int cpus, bool measure)
+{
+    bool ok = true;
+    uint8_t *ref = malloc(width * height * 4);
+    /* Large enough for rotated images. */
+    uint8_t *rgb = malloc((width * 4 + BENCH_PADDING) * width);
+    if (!ref || !rgb)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    if (measure)
+	printf("frame    %s %dx%d\n", source, width, height);
+    for (int m = 0; m < DEMOSAIC_METHODS_NB; m++) {
+	ok = bench_method(m, bayer, ref, rgb, width, height, cpus, measure)
+	    && ok;
+	bool same = bench_stream(m, bayer, width, height);
+	ok = ok && same;
+	if (measure)
+	    printf("%-8s %-10s %4dx%-4d streamed lines%s\n", methods[m],
+		    "best", width, height, same ? "" : "  MISMATCH");
+    }
+    if (!measure)
+	printf("check    %s %dx%d, %s\n", source, width, height,
+		ok ? "ok" : "MISMATCH");
+    free(ref);
+    free(rgb);
+    return ok;
+}
+
+/* Measure compression, on a synthetic image with some sensor noise, as
+ * random frames can not be compressed. */
+static void
+bench_compression(unsigned *seed)
+{
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	int width = sizes[i].width;
+	int height = sizes[i].height;
+	uint8_t *bgra = malloc(width * height * 4);
+	uint8_t *bayer = malloc(width * height);
+	if (!bgra || !bayer)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+	bench_pattern(BENCH_BLOCKS, bgra, width, height);
+	bench_mosaic(bgra, bayer, width, height);
+	for (int j = 0; j < width * height; j++) {
+	    int v = bayer[j] + rand_r(seed) % 3 - 1;
+	    bayer[j] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+	bench_png("blocks", bayer, width, height);
+	free(bgra);
+	free(bayer);
+    }
+}
+
+/* Measure preview, in input megapixels per second to compare with full
+ * conversion. */
+static void
+bench_preview(void)
+{
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	int width = sizes[i].width;
+	int height = sizes[i].height;
+	struct demosaic_variant superpixel = {
+	    "scalar", bench_superpixel, NULL };
+	uint8_t *bayer = calloc(width * height, 1);
+	uint8_t *rgb = malloc(width * height);
+	if (!bayer || !rgb)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+	struct bench_time result;
+	bench_run(&superpixel, NULL, bayer, rgb, width * 2, width, height,
+		DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, &result);
+	bench_print("preview", superpixel.name, width, height, &result);
+	printf("\n");
+	free(bayer);
+	free(rgb);
+    }
+}
+
+/* Measure quality, on images with a known result. */
+static void
+bench_quality(void)
+{
+    int width = 1024, height = 768;
+    uint8_t *bayer = malloc(width * height);
+    uint8_t *orig = malloc(width * height * 4);
+    uint8_t *rgb = malloc(width * height * 4);
+    if (!bayer || !orig || !rgb)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    for (int p = 0; p < BENCH_PATTERNS_NB; p++) {
+	bench_pattern(p, orig, width, height);
+	bench_mosaic(orig, bayer, width, height);
+	printf("psnr     %-8s", patterns[p]);
+	for (int m = 0; m < DEMOSAIC_METHODS_NB; m++) {
+	    int n;
+	    const struct demosaic_variant *variants = demosaic_variants(m, &n);
+	    variants[0].fn(bayer, rgb, width * 4, width, height);
+	    printf(" %s %6.2f dB", methods[m],
+		    bench_psnr(orig, rgb, width, height));
+	}
+	printf("\n");
+    }
+    free(bayer);
+    free(orig);
+    free(rgb);
+}
+
+static void
+usage(int status, const char *msg)
+{
+    if (msg)
+	error(0, 0, "%s", msg);
+    fprintf(status == EXIT_SUCCESS ? stdout : stderr,
+	    "usage: %s [options] [FILE...]\n"
+	    "\n"
+	    "Check demosaicing implementations against the reference and"
+	    " measure them,\n"
+	    "on random frames, then on the first frame of each raw file.\n"
+	    "\n"
+	    "positional arguments:\n"
+	    "  FILE               raw file saved by moticam\n"
+	    "\n"
+	    "optional arguments:\n"
+	    "  -h, --help         show this help message and exit\n"
+	    "  -c, --check        only check, do not measure\n"
+	    "  -w, --width VALUE  image width in raw files of bare images"
+	    " (512, 1024\n"
+	    "                     or 2048, default: 1024)\n"
+	    , program_invocation_name);
+    exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+    int file_width = 1024, file_height = 768;
+    bool measure = true;
+    static const struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "check", no_argument, 0, 'c' },
+	{ "width", required_argument, 0, 'w' },
+	{ NULL },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "hcw:", long_options, NULL)) != -1) {
+	switch (c) {
+	case 'h':
+	    usage(EXIT_SUCCESS, NULL);
+	    break;
+	case 'c':
+	    measure = false;
+	    break;
+	case 'w':
+	    file_width = 0;
+	    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (atoi(optarg) == sizes[i].width) {
+		    file_width = sizes[i].width;
+		    file_height = sizes[i].height;
+		}
+	    }
+	    if (!file_width)
+		usage(EXIT_FAILURE, "bad width value");
+	    break;
+	default:
+	    usage(EXIT_FAILURE, NULL);
+	}
+    }
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+	cpus = 1;
+    bool ok = true;
+    unsigned seed = 1;
+    if (measure)
+	bench_counters_open();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	int width = sizes[i].width;
+	int height = sizes[i].height;
+	uint8_t *bayer = malloc(width * height);
+	if (!bayer)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+	for (int j = 0; j < width * height; j++)
+	    bayer[j] = rand_r(&seed);
+	ok = bench_frame("random", bayer, width, height, cpus, measure)
+	    && ok;
+	free(bayer);
+    }
+    if (measure)
+	bench_compression(&seed);
+    for (int i = optind; i < argc; i++) {
+	struct replay *replay = replay_open(argv[i], file_width,
+		file_height);
+	int width = replay_width(replay);
+	int height = replay_height(replay);
+	const struct rawfile_frame *frame = replay_frame(replay, 0);
+	if (frame)
+	    printf("file     %s %dx%d %d frames, exposure %.1f ms gain %.2f\n",
+		    argv[i], width, height, replay_count(replay),
+		    frame->exposure, frame->gain);
+	ok = bench_frame(argv[i], replay_image(replay, 0), width, height,
+		cpus, measure) && ok;
+	if (measure)
+	    bench_png(argv[i], replay_image(replay, 0), width, height);
+	replay_close(replay);
+    }
+    if (measure) {
+	bench_preview();
+	bench_quality();
+    }
+    if (!ok)
+	error(0, 0, "some implementations differ from the reference");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
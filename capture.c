@@ -0,0 +1,671 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <error.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "capture.h"
+#include "assembler.h"
+#include "device.h"
+#include "replay.h"
+#include "ring.h"
+
+#define ENDPOINT 0x83
+
+/* Largest transfer.  Transfers smaller than big images make them span
+ * several transfers, ended by a short or zero length packet. */
+#define TRANSFER_SIZE (16 * 16384)
+
+/* Give up measuring settling latency after this number of frames. */
+#define SETTLE_FRAMES_MAX 16
+
+/* Transfer and the frame it is filling. */
+struct capture_transfer {
+    struct capture *capture;
+    struct libusb_transfer *transfer;
+    struct frame *frame;
+};
+
+/* The capture thread owns the device and all transfers.  Complete frames
+ * are pushed to the full ring, the consumer gives them back to the pool
+ * where they are taken to submit transfers again. */
+struct capture {
+    libusb_context *usb;
+    libusb_device_handle *handle;
+    struct pool *pool;
+    int image_size;
+    int transfers_nb;
+    struct capture_transfer *transfers;
+    int queue_size;
+    struct ring full;
+    /* Posted for each frame pushed to the full ring. */
+    sem_t full_sem;
+    pthread_t thread;
+    /* Number of submitted transfers, capture thread only. */
+    int active;
+    atomic_bool stopping;
+    /* Requested settings, can be changed from any thread. */
+    pthread_mutex_t settings_mutex;
+    double exposure;
+    double gain;
+    bool settings_changed;
+    /* Settings sent to the device, capture thread only. */
+    capture_apply_cb apply;
+    void *apply_data;
+    double applied_exposure;
+    double applied_gain;
+    /* Settings must be sent again to a reopened device. */
+    bool reapply;
+    /* An image boundary was seen since settings were last checked. */
+    bool boundary;
+    /* Waiting for a stable image after a settings change, from the frame
+     * with the given sequence number. */
+    bool settling;
+    uint32_t settle_sequence;
+    struct timespec settle_time;
+    /* Mean level and arrival time of the previous settling frame. */
+    double settle_mean;
+    struct timespec settle_last;
+    struct assembler assembler;
+    /* Device recovery, capture thread only. */
+    capture_reopen_cb reopen;
+    void *reopen_data;
+    bool hotplug;
+    libusb_hotplug_callback_handle hotplug_handle;
+    /* Device was lost, waiting to open it again. */
+    bool lost;
+    /* Device was opened again, waiting for the first frame. */
+    bool recovering;
+    /* A camera was attached since the last attempt. */
+    bool arrived;
+    struct timespec lost_time;
+    struct timespec retry_time;
+    /* Replay source, used instead of the device when not NULL. */
+    struct replay *replay;
+    double rate;
+    /* Prefix for messages. */
+    const char *prefix;
+    struct capture_stats stats;
+};
+
+static void LIBUSB_CALL
+capture_callback(struct libusb_transfer *transfer);
+
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/* Device is gone or broken, stop all transfers and wait until it can be
+ * opened again. */
+static void
+capture_lost(struct capture *capture, const char *reason)
+{
+    if (!capture->reopen)
+	error(EXIT_FAILURE, 0, "%scan not read data: %s", capture->prefix,
+		reason);
+    if (capture->lost)
+	return;
+    fprintf(stderr, "%sdevice lost (%s), waiting for it\n", capture->prefix,
+	    reason);
+    capture->lost = true;
+    capture->recovering = false;
+    capture->arrived = false;
+    clock_gettime(CLOCK_MONOTONIC, &capture->lost_time);
+    capture->retry_time = capture->lost_time;
+    assembler_reset(&capture->assembler);
+    for (int i = 0; i < capture->transfers_nb; i++)
+	libusb_cancel_transfer(capture->transfers[i].transfer);
+}
+
+static void
+capture_submit(struct capture *capture, struct capture_transfer *ct)
+{
+    int size = ct->frame->size < TRANSFER_SIZE
+	? ct->frame->size : TRANSFER_SIZE;
+    libusb_fill_bulk_transfer(ct->transfer, capture->handle, ENDPOINT,
+	    ct->frame->data, size, capture_callback, ct, 0);
+    int r = libusb_submit_transfer(ct->transfer);
+    if (r == LIBUSB_ERROR_NO_DEVICE)
+	capture_lost(capture, libusb_strerror(r));
+    else if (r)
+	error(EXIT_FAILURE, 0, "%scan not submit transfer: %s",
+		capture->prefix, libusb_strerror(r));
+    else
+	capture->active++;
+}
+
+/* Send requested settings if they changed, to be called between two
+ * frames. */
+static void
+capture_apply_settings(struct capture *capture)
+{
+    pthread_mutex_lock(&capture->settings_mutex);
+    bool changed = capture->settings_changed;
+    double exposure = capture->exposure;
+    double gain = capture->gain;
+    capture->settings_changed = false;
+    pthread_mutex_unlock(&capture->settings_mutex);
+    if (!changed && !capture->reapply)
+	return;
+    capture->reapply = false;
+    if (!capture->apply) {
+	capture->applied_exposure = exposure;
+	capture->applied_gain = gain;
+	return;
+    }
+    int r = capture->apply(capture->apply_data, exposure, gain);
+    if (r) {
+	/* Settings are sent again once the device is back. */
+	capture_lost(capture, libusb_strerror(r));
+	return;
+    }
+    if (exposure != capture->applied_exposure
+	    || gain != capture->applied_gain) {
+	/* The image being received was started with the previous
+	 * settings. */
+	capture->settling = true;
+	capture->settle_sequence = capture->assembler.sequence;
+	clock_gettime(CLOCK_MONOTONIC, &capture->settle_time);
+	capture->applied_exposure = exposure;
+	capture->applied_gain = gain;
+    }
+}
+
+/* Mean level of a sample of the image pixels. */
+static double
+capture_frame_mean(struct capture *capture, const struct frame *frame)
+{
+    unsigned sum = 0;
+    int n = 0;
+    for (int i = 0; i < capture->image_size; i += 61, n++)
+	sum += frame->data[i];
+    return (double) sum / n;
+}
+
+/* After a settings change, mark frames until two consecutive frames have
+ * the same level, then record how many frames had to be discarded. */
+static void
+capture_settle(struct capture *capture, struct frame *frame)
+{
+    struct capture_stats *stats = &capture->stats;
+    double mean = capture_frame_mean(capture, frame);
+    int frames = frame->sequence - capture->settle_sequence;
+    double prev = capture->settle_mean;
+    bool stable = frames > 0
+	&& fabs(mean - prev) <= 1.0 + 0.02 * fmax(mean, prev);
+    if (stable || frames >= SETTLE_FRAMES_MAX) {
+	/* When stable, the previous frame was already settled. */
+	struct timespec *settled = stable ? &capture->settle_last
+	    : &frame->timestamp;
+	if (stable)
+	    frames--;
+	stats->settles++;
+	stats->settle_frames_sum += frames;
+	if (frames > stats->settle_frames_max)
+	    stats->settle_frames_max = frames;
+	stats->settle_time_sum += timespec_diff(settled,
+		&capture->settle_time);
+	capture->settling = false;
+	if (stable)
+	    return;
+    }
+    frame->flags |= FRAME_SETTLING;
+    capture->settle_mean = mean;
+    capture->settle_last = frame->timestamp;
+}
+
+/* Fill frame information and update statistics. */
+static void
+capture_frame_info(struct capture *capture, struct frame *frame)
+{
+    struct capture_stats *stats = &capture->stats;
+    clock_gettime(CLOCK_MONOTONIC, &frame->timestamp);
+    frame->exposure = capture->applied_exposure;
+    frame->gain = capture->applied_gain;
+    if (capture->settling)
+	capture_settle(capture, frame);
+    if (capture->recovering) {
+	/* Account for frames missed while the device was away, and do not
+	 * count this interval in statistics. */
+	double recovery = timespec_diff(&frame->timestamp,
+		&capture->lost_time);
+	if (stats->good > 1) {
+	    double interval = stats->interval_sum / (stats->good - 1);
+	    uint32_t missed = recovery / interval;
+	    frame->sequence += missed;
+	    capture->assembler.sequence += missed;
+	}
+	fprintf(stderr, "%sdevice recovered in %.0f ms\n", capture->prefix,
+		recovery * 1e3);
+	stats->reconnects++;
+	stats->recovery_sum += recovery;
+	if (recovery > stats->recovery_max)
+	    stats->recovery_max = recovery;
+	capture->recovering = false;
+    } else if (stats->good) {
+	double interval = timespec_diff(&frame->timestamp, &stats->last);
+	stats->interval_sum += interval;
+	stats->interval_sum2 += interval * interval;
+    } else
+	stats->first = frame->timestamp;
+    stats->last = frame->timestamp;
+    stats->good++;
+}
+
+/* Hand a complete frame to the consumer if there is room in the queue,
+ * else drop it. */
+static void
+capture_queue(struct capture *capture, struct frame *frame)
+{
+    capture_frame_info(capture, frame);
+    int count = ring_count(&capture->full);
+    if (count >= capture->queue_size) {
+	capture->stats.dropped++;
+	frame_unref(frame);
+    } else {
+	ring_push(&capture->full, frame);
+	sem_post(&capture->full_sem);
+	if (count + 1 > capture->stats.queue_high)
+	    capture->stats.queue_high = count + 1;
+    }
+}
+
+static void LIBUSB_CALL
+capture_callback(struct libusb_transfer *transfer)
+{
+    struct capture_transfer *ct = transfer->user_data;
+    struct capture *capture = ct->capture;
+    capture->active--;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED
+	    || atomic_load(&capture->stopping) || capture->lost)
+	return;
+    struct frame *frame = NULL;
+    if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+	/* Received data was lost, wait for the next image. */
+	assembler_reset(&capture->assembler);
+    } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+	capture_lost(capture, "device disconnected");
+	return;
+    } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	char reason[32];
+	snprintf(reason, sizeof(reason), "transfer status %d",
+		transfer->status);
+	capture_lost(capture, reason);
+	return;
+    } else {
+	/* A transfer shorter than requested was ended by a short or zero
+	 * length packet, this is the end of an image. */
+	bool end = transfer->actual_length < transfer->length;
+	frame = assembler_push(&capture->assembler, ct->frame,
+		transfer->actual_length, end);
+	ct->frame = NULL;
+	if (end)
+	    capture->boundary = true;
+    }
+    if (!ct->frame) {
+	ct->frame = pool_get(capture->pool);
+	if (!ct->frame) {
+	    /* Pool is empty, sacrifice the new frame or the partial one to
+	     * keep the transfer going. */
+	    if (frame) {
+		capture->stats.dropped++;
+		frame_unref(frame);
+		frame = NULL;
+	    } else
+		assembler_reset(&capture->assembler);
+	    ct->frame = pool_get(capture->pool);
+	}
+    }
+    if (frame)
+	capture_queue(capture, frame);
+    capture_submit(capture, ct);
+}
+
+static int LIBUSB_CALL
+capture_hotplug(libusb_context *usb, libusb_device *device,
+	libusb_hotplug_event event, void *user_data)
+{
+    struct capture *capture = user_data;
+    (void) usb;
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+	capture->arrived = true;
+    else if (capture->handle && device == libusb_get_device(capture->handle))
+	capture_lost(capture, "device detached");
+    return 0;
+}
+
+/* Once all transfers are done, try to open the lost device again, at
+ * once when a camera is attached, else from time to time. */
+static void
+capture_resume(struct capture *capture)
+{
+    if (capture->handle) {
+	libusb_close(capture->handle);
+	capture->handle = NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!capture->arrived && timespec_diff(&now, &capture->retry_time) < 1.0)
+	return;
+    capture->arrived = false;
+    capture->retry_time = now;
+    capture->handle = capture->reopen(capture->reopen_data);
+    if (!capture->handle)
+	return;
+    capture->lost = false;
+    capture->recovering = true;
+    capture->reapply = true;
+    for (int i = 0; i < capture->transfers_nb && !capture->lost; i++)
+	capture_submit(capture, &capture->transfers[i]);
+}
+
+static void *
+capture_thread(void *arg)
+{
+    struct capture *capture = arg;
+    capture->lost = false;
+    capture->recovering = false;
+    for (int i = 0; i < capture->transfers_nb && !capture->lost; i++)
+	capture_submit(capture, &capture->transfers[i]);
+    bool cancelled = false;
+    while (!cancelled || capture->active) {
+	if (!cancelled && atomic_load(&capture->stopping)) {
+	    for (int i = 0; i < capture->transfers_nb; i++)
+		libusb_cancel_transfer(capture->transfers[i].transfer);
+	    cancelled = true;
+	}
+	if (capture->lost && !cancelled && !capture->active)
+	    capture_resume(capture);
+	if (capture->boundary && !capture->lost && !cancelled) {
+	    capture->boundary = false;
+	    capture_apply_settings(capture);
+	}
+	struct timeval tv = { 0, 100000 };
+	int r = libusb_handle_events_timeout_completed(capture->usb, &tv,
+		NULL);
+	if (r && r != LIBUSB_ERROR_INTERRUPTED)
+	    error(EXIT_FAILURE, 0, "%scan not handle events: %s",
+		    capture->prefix, libusb_strerror(r));
+    }
+    for (int i = 0; i < capture->transfers_nb; i++) {
+	frame_unref(capture->transfers[i].frame);
+	capture->transfers[i].frame = NULL;
+    }
+    assembler_reset(&capture->assembler);
+    return NULL;
+}
+
+/* Replay thread, deliver recorded images at the requested rate, or as
+ * fast as the consumer takes them. */
+static void *
+capture_replay_thread(void *arg)
+{
+    struct capture *capture = arg;
+    int count = replay_count(capture->replay);
+    int index = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!atomic_load(&capture->stopping)) {
+	if (capture->rate > 0.0) {
+	    long period_ns = 1e9 / capture->rate;
+	    next.tv_nsec += period_ns;
+	    while (next.tv_nsec >= 1000000000) {
+		next.tv_sec++;
+		next.tv_nsec -= 1000000000;
+	    }
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if (timespec_diff(&now, &next) * 1e9 > period_ns)
+		/* Late by more than a period, do not try to catch up. */
+		next = now;
+	    else
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	} else if (ring_count(&capture->full) >= capture->queue_size) {
+	    /* As fast as possible, but without dropping. */
+	    delay_us(100);
+	    continue;
+	}
+	capture_apply_settings(capture);
+	struct frame *frame = pool_get(capture->pool);
+	if (!frame) {
+	    if (capture->rate > 0.0) {
+		capture->stats.dropped++;
+		capture->assembler.sequence++;
+	    } else
+		delay_us(100);
+	    continue;
+	}
+	memcpy(frame->data, replay_image(capture->replay, index),
+		capture->image_size);
+	index = (index + 1) % count;
+	frame->length = capture->image_size;
+	frame->sequence = capture->assembler.sequence++;
+	frame->flags = 0;
+	capture_queue(capture, frame);
+    }
+    return NULL;
+}
+
+struct capture *
+capture_new(libusb_context *usb, libusb_device_handle *handle,
+	struct pool *pool, int width, int height, int transfers_nb,
+	int queue_size)
+{
+    struct capture *capture = malloc(sizeof(*capture));
+    if (!capture)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    capture->usb = usb;
+    capture->handle = handle;
+    capture->pool = pool;
+    capture->image_size = width * height;
+    capture->transfers_nb = transfers_nb;
+    capture->queue_size = queue_size;
+    capture->transfers = calloc(transfers_nb, sizeof(*capture->transfers));
+    if (transfers_nb && !capture->transfers)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    for (int i = 0; i < transfers_nb; i++) {
+	struct capture_transfer *ct = &capture->transfers[i];
+	ct->capture = capture;
+	ct->transfer = libusb_alloc_transfer(0);
+	if (!ct->transfer)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+	ct->frame = NULL;
+    }
+    ring_init(&capture->full, queue_size);
+    sem_init(&capture->full_sem, 0, 0);
+    capture->active = 0;
+    atomic_init(&capture->stopping, false);
+    pthread_mutex_init(&capture->settings_mutex, NULL);
+    capture->exposure = 0.0;
+    capture->gain = 0.0;
+    capture->settings_changed = false;
+    capture->apply = NULL;
+    capture->apply_data = NULL;
+    capture->reapply = false;
+    capture->boundary = false;
+    capture->settling = false;
+    assembler_init(&capture->assembler, capture->image_size);
+    capture->reopen = NULL;
+    capture->reopen_data = NULL;
+    capture->hotplug = usb && device_hotplug_register(usb, capture_hotplug,
+	    capture, &capture->hotplug_handle);
+    capture->lost = false;
+    capture->recovering = false;
+    capture->arrived = false;
+    capture->replay = NULL;
+    capture->rate = 0.0;
+    capture->prefix = "";
+    memset(&capture->stats, 0, sizeof(capture->stats));
+    return capture;
+}
+
+struct capture *
+capture_new_replay(struct replay *replay, double rate, struct pool *pool,
+	int width, int height, int queue_size)
+{
+    struct capture *capture = capture_new(NULL, NULL, pool, width, height,
+	    0, queue_size);
+    capture->replay = replay;
+    capture->rate = rate;
+    return capture;
+}
+
+void
+capture_start(struct capture *capture)
+{
+    for (int i = 0; i < capture->transfers_nb; i++) {
+	struct frame *frame = pool_get(capture->pool);
+	if (!frame)
+	    error(EXIT_FAILURE, 0, "frame pool too small");
+	capture->transfers[i].frame = frame;
+    }
+    pthread_mutex_lock(&capture->settings_mutex);
+    capture->applied_exposure = capture->exposure;
+    capture->applied_gain = capture->gain;
+    capture->settings_changed = false;
+    pthread_mutex_unlock(&capture->settings_mutex);
+    capture->reapply = false;
+    capture->boundary = false;
+    capture->settling = false;
+    atomic_store(&capture->stopping, false);
+    int r = pthread_create(&capture->thread, NULL,
+	    capture->replay ? capture_replay_thread : capture_thread, capture);
+    if (r)
+	error(EXIT_FAILURE, r, "can not create capture thread");
+}
+
+void
+capture_set_reopen(struct capture *capture, capture_reopen_cb reopen,
+	void *data)
+{
+    capture->reopen = reopen;
+    capture->reopen_data = data;
+}
+
+void
+capture_set_apply(struct capture *capture, capture_apply_cb apply,
+	void *data)
+{
+    capture->apply = apply;
+    capture->apply_data = data;
+}
+
+void
+capture_set_prefix(struct capture *capture, const char *prefix)
+{
+    capture->prefix = prefix;
+}
+
+libusb_device_handle *
+capture_get_handle(struct capture *capture)
+{
+    return capture->handle;
+}
+
+void
+capture_set_settings(struct capture *capture, double exposure, double gain)
+{
+    pthread_mutex_lock(&capture->settings_mutex);
+    capture->exposure = exposure;
+    capture->gain = gain;
+    capture->settings_changed = true;
+    pthread_mutex_unlock(&capture->settings_mutex);
+}
+
+struct frame *
+capture_get(struct capture *capture)
+{
+    while (sem_wait(&capture->full_sem) == -1) {
+	if (errno != EINTR)
+	    error(EXIT_FAILURE, errno, "can not wait for frame");
+    }
+    return ring_pop(&capture->full);
+}
+
+struct frame *
+capture_get_timeout(struct capture *capture, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(&capture->full_sem, &deadline) == -1) {
+	if (errno == ETIMEDOUT)
+	    return NULL;
+	if (errno != EINTR)
+	    error(EXIT_FAILURE, errno, "can not wait for frame");
+    }
+    return ring_pop(&capture->full);
+}
+
+void
+capture_stop(struct capture *capture)
+{
+    atomic_store(&capture->stopping, true);
+    pthread_join(capture->thread, NULL);
+    /* Give back frames which were not taken. */
+    struct frame *frame;
+    while ((frame = ring_pop(&capture->full))) {
+	sem_wait(&capture->full_sem);
+	frame_unref(frame);
+    }
+}
+
+void
+capture_get_stats(struct capture *capture, struct capture_stats *stats)
+{
+    *stats = capture->stats;
+    stats->short_ = capture->assembler.short_;
+    stats->long_ = capture->assembler.long_;
+    stats->stitched = capture->assembler.stitched;
+}
+
+void
+capture_free(struct capture *capture)
+{
+    if (capture->hotplug)
+	libusb_hotplug_deregister_callback(capture->usb,
+		capture->hotplug_handle);
+    for (int i = 0; i < capture->transfers_nb; i++)
+	libusb_free_transfer(capture->transfers[i].transfer);
+    ring_uninit(&capture->full);
+    sem_destroy(&capture->full_sem);
+    pthread_mutex_destroy(&capture->settings_mutex);
+    free(capture->transfers);
+    free(capture);
+}
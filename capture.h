@@ -0,0 +1,153 @@
+#ifndef capture_h
+#define capture_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <libusb.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "replay.h"
+
+/* Asynchronous capture engine.
+ *
+ * A capture thread keeps several bulk transfers queued on the image
+ * endpoint and pushes complete frames to a bounded queue, so that the
+ * device is still read while frames are being processed.
+ *
+ * Frames can also come from a recorded file, to run the processing
+ * pipeline without a camera. */
+struct capture;
+
+/* Capture statistics. */
+struct capture_stats {
+    /* Number of complete frames. */
+    int good;
+    /* Number of frames shorter or longer than the image, discarded. */
+    int short_;
+    int long_;
+    /* Number of frames received in several transfers. */
+    int stitched;
+    /* Maximum number of frames waiting in the queue. */
+    int queue_high;
+    /* Number of frames dropped because the queue was full. */
+    int dropped;
+    /* Arrival time of first and last good frames. */
+    struct timespec first;
+    struct timespec last;
+    /* Sum and sum of squares of intervals between good frames, in
+     * seconds, to compute frame rate and jitter. */
+    double interval_sum;
+    double interval_sum2;
+    /* Number of times the device was lost and recovered. */
+    int reconnects;
+    /* Sum and maximum of time from loss to first frame, in seconds. */
+    double recovery_sum;
+    double recovery_max;
+    /* Number of settings changes with a measured settling latency. */
+    int settles;
+    /* Sum and maximum of the number of frames to discard after a change,
+     * and sum of the time from change to first settled frame. */
+    int settle_frames_sum;
+    int settle_frames_max;
+    double settle_time_sum;
+};
+
+/* Open and initialise the lost device again, return NULL if not
+ * possible yet. */
+typedef libusb_device_handle *(*capture_reopen_cb)(void *data);
+
+/* Send settings to the device, called from the capture thread.  Return 0,
+ * or a libusb error, which is handled as a lost device. */
+typedef int (*capture_apply_cb)(void *data, double exposure, double gain);
+
+/* Allocate transfers for the given image size, with up to queue_size
+ * frames waiting for the consumer.  Frames are taken from the given pool,
+ * which must be large enough for all transfers, the queue and the frames
+ * held by consumers. */
+struct capture *
+capture_new(libusb_context *usb, libusb_device_handle *handle,
+	struct pool *pool, int width, int height, int transfers_nb,
+	int queue_size);
+
+/* Same as capture_new, but images are read from a replay file, at the
+ * given rate in frames per second, or as fast as possible if 0. */
+struct capture *
+capture_new_replay(struct replay *replay, double rate, struct pool *pool,
+	int width, int height, int queue_size);
+
+/* Set the function used to open the device again when it is lost.
+ * Without it, losing the device is fatal. */
+void
+capture_set_reopen(struct capture *capture, capture_reopen_cb reopen,
+	void *data);
+
+/* Set the function used to send new settings to the device.  Without it,
+ * settings are only recorded in frames. */
+void
+capture_set_apply(struct capture *capture, capture_apply_cb apply,
+	void *data);
+
+/* Set the prefix of messages, to tell cameras apart.  The string is not
+ * copied. */
+void
+capture_set_prefix(struct capture *capture, const char *prefix);
+
+/* Get the current device handle, which changes when the device is opened
+ * again.  Return NULL if lost.  Only valid when capture is stopped. */
+libusb_device_handle *
+capture_get_handle(struct capture *capture);
+
+/* Start the capture thread. */
+void
+capture_start(struct capture *capture);
+
+/* Change device settings, from any thread.  They are applied by the
+ * capture thread between two frames, then frames are marked with
+ * FRAME_SETTLING until the image is stable.  Before capture_start, give
+ * the settings the device was initialised with. */
+void
+capture_set_settings(struct capture *capture, double exposure, double gain);
+
+/* Wait for the next complete frame and return it.  The caller owns one
+ * reference and must give it back using frame_unref. */
+struct frame *
+capture_get(struct capture *capture);
+
+/* Same as capture_get, but return NULL if no frame arrived after the given
+ * number of milliseconds. */
+struct frame *
+capture_get_timeout(struct capture *capture, int timeout_ms);
+
+/* Stop the capture thread. */
+void
+capture_stop(struct capture *capture);
+
+/* Get statistics, only exact once the capture is stopped. */
+void
+capture_get_stats(struct capture *capture, struct capture_stats *stats);
+
+/* Release all resources. */
+void
+capture_free(struct capture *capture);
+
+#endif /* capture_h */
@@ -0,0 +1,133 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <error.h>
+
+#include "assembler.h"
+#include "pool.h"
+
+/* Checks of the parts which do not need a camera, fast enough to be run
+ * after each change. */
+
+/* Transfers fed to the assembler, with the expected sequence number of
+ * the returned frame, or -1 if none, and its flags.  Images are 64
+ * bytes.  The last image comes as it does from the camera when transfers
+ * are smaller than the image: full transfers, then a zero length
+ * packet. */
+static const struct {
+    const char *what;
+    int length;
+    bool end;
+    int sequence;
+    int flags;
+} assembler_script[] = {
+    { "whole", 64, true, 0, 0 },
+    { "split start", 32, false, -1, 0 },
+    { "split end", 32, true, 1, FRAME_STITCHED },
+    { "short", 20, true, -1, 0 },
+    { "after short", 64, true, 3, FRAME_RESYNC },
+    { "long start", 40, false, -1, 0 },
+    { "long end", 40, true, -1, 0 },
+    { "after long", 64, true, 5, FRAME_RESYNC },
+    { "before zlp", 64, false, -1, 0 },
+    { "zlp", 0, true, 6, FRAME_STITCHED },
+    { "overlong", 100, false, -1, 0 },
+    { "unlocked", 30, false, -1, 0 },
+    { "boundary", 10, true, -1, 0 },
+    { "relocked", 64, true, 8, FRAME_RESYNC },
+    { "chunk 1", 16, false, -1, 0 },
+    { "chunk 2", 16, false, -1, 0 },
+    { "chunk 3", 16, false, -1, 0 },
+    { "chunk 4", 16, false, -1, 0 },
+    { "chunks zlp", 0, true, 9, FRAME_STITCHED },
+};
+
+/* Feed the assembler with scripted transfers and check frame boundaries,
+ * flags and counters.  Transfer bytes follow a counter, so that a badly
+ * stitched image breaks the sequence. */
+static bool
+check_assembler(void)
+{
+    struct pool *pool = pool_new(8, 8, 4);
+    struct assembler assembler;
+    assembler_init(&assembler, 64);
+    bool ok = true;
+    uint8_t counter = 0;
+    int n = sizeof(assembler_script) / sizeof(assembler_script[0]);
+    for (int i = 0; i < n; i++) {
+	struct frame *frame = pool_get(pool);
+	if (!frame)
+	    error(EXIT_FAILURE, 0, "frame pool too small");
+	for (int j = 0; j < assembler_script[i].length; j++)
+	    frame->data[j] = counter++;
+	frame = assembler_push(&assembler, frame,
+		assembler_script[i].length, assembler_script[i].end);
+	int sequence = frame ? (int) frame->sequence : -1;
+	int flags = frame ? frame->flags : 0;
+	bool same = sequence == assembler_script[i].sequence
+	    && flags == assembler_script[i].flags;
+	for (int j = 1; frame && j < 64; j++)
+	    same = same && (uint8_t) (frame->data[j - 1] + 1)
+		== frame->data[j];
+	if (frame && frame->length != 64)
+	    same = false;
+	if (!same) {
+	    fprintf(stderr, "assembler: %s: got sequence %d flags %d,"
+		    " expected %d flags %d\n", assembler_script[i].what,
+		    sequence, flags, assembler_script[i].sequence,
+		    assembler_script[i].flags);
+	    ok = false;
+	}
+	if (frame)
+	    frame_unref(frame);
+    }
+    if (assembler.short_ != 2 || assembler.long_ != 2
+	    || assembler.stitched != 3) {
+	fprintf(stderr, "assembler: got %d short, %d long, %d stitched,"
+		" expected 2, 2 and 3\n", assembler.short_, assembler.long_,
+		assembler.stitched);
+	ok = false;
+    }
+    assembler_reset(&assembler);
+    struct pool_stats stats;
+    pool_get_stats(pool, &stats);
+    if (stats.used) {
+	fprintf(stderr, "assembler: %d frames not given back\n", stats.used);
+	ok = false;
+    }
+    pool_free(pool);
+    printf("assembler %d scripted transfers, %s\n", n, ok ? "ok" : "failed");
+    return ok;
+}
+
+int
+main(void)
+{
+    bool ok = check_assembler();
+    if (!ok)
+	error(0, 0, "some checks failed");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1364 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define DEMOSAIC_X86 1
+#endif
+
+#include "demosaic.h"
+#include "workers.h"
+
+/* Reference implementation. */
+static void
+demosaic_bilinear_scalar(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    /*
+     * Compute missing value using an average of its neighbours.
+     * Input pattern:
+     * G R G R G R
+     * B G B G B G
+     * G R G R G R
+     * B G B G B G
+     */
+    const int in_stride = width;
+    const int out_stride = pitch;
+    /* Skip first line and column. */
+    const uint8_t *in = bayer + in_stride + 1;
+    uint8_t *out = rgb + out_stride + 4;
+    /* Loop over lines. */
+    for (int i = 1; i < height - 1; i += 2) {
+	/* Even lines. */
+	const uint8_t *in_stop = in + (width - 2);
+	while (in != in_stop) {
+	    *out++ = (in[-1] + in[+1] + 1) >> 1;                 /* B */
+	    *out++ = in[0];                                      /* G */
+	    *out++ = (in[-in_stride] + in[+in_stride] + 1) >> 1; /* R */
+	    *out++ = 255;                                        /* A */
+	    in++;
+	    *out++ = in[0];                                      /* B */
+	    *out++ = (in[-in_stride] + in[+in_stride]            /* G */
+		    + in[-1] + in[+1] + 2) >> 2;
+	    *out++ = (in[-in_stride - 1] + in[-in_stride + 1]    /* R */
+		    + in[+in_stride - 1] + in[+in_stride + 1] + 2) >> 2;
+	    *out++ = 255;                                        /* A */
+	    in++;
+	}
+	/* Fill first and last pixels. */
+	out[-(width - 1) * 4 + 0] = out[-(width - 2) * 4 + 0];
+	out[-(width - 1) * 4 + 1] = out[-(width - 2) * 4 + 1];
+	out[-(width - 1) * 4 + 2] = out[-(width - 2) * 4 + 2];
+	out[-(width - 1) * 4 + 3] = out[-(width - 2) * 4 + 3];
+	out[0] = out[-4];
+	out[1] = out[-3];
+	out[2] = out[-2];
+	out[3] = out[-1];
+	out += out_stride - (width - 2) * 4;
+	in += in_stride - (width - 2);
+	/* Odd lines. */
+	in_stop = in + (width - 2);
+	while (in != in_stop) {
+	    *out++ = (in[-in_stride - 1] + in[-in_stride + 1]    /* B */
+		    + in[+in_stride - 1] + in[+in_stride + 1] + 2) >> 2;
+	    *out++ = (in[-in_stride] + in[+in_stride]            /* G */
+		    + in[-1] + in[+1] + 2) >> 2;
+	    *out++ = in[0];                                      /* R */
+	    *out++ = 255;                                        /* A */
+	    in++;
+	    *out++ = (in[-in_stride] + in[+in_stride] + 1) >> 1; /* B */
+	    *out++ = in[0];                                      /* G */
+	    *out++ = (in[-1] + in[+1] + 1) >> 1;                 /* R */
+	    *out++ = 255;                                        /* A */
+	    in++;
+	}
+	/* Fill first and last pixels. */
+	out[-(width - 1) * 4 + 0] = out[-(width - 2) * 4 + 0];
+	out[-(width - 1) * 4 + 1] = out[-(width - 2) * 4 + 1];
+	out[-(width - 1) * 4 + 2] = out[-(width - 2) * 4 + 2];
+	out[-(width - 1) * 4 + 3] = out[-(width - 2) * 4 + 3];
+	out[0] = out[-4];
+	out[1] = out[-3];
+	out[2] = out[-2];
+	out[3] = out[-1];
+	out += out_stride - (width - 2) * 4;
+	in += in_stride - (width - 2);
+    }
+    /* Last line. */
+    out -= 4;
+    memcpy (out, out - out_stride, width * 4);
+    /* First line. */
+    out -= (height - 1) * out_stride;
+    memcpy (out, out + out_stride, width * 4);
+}
+
+int
+demosaic_bytes_per_pixel(enum demosaic_format format)
+{
+    return format == DEMOSAIC_BGRA32 ? 4 : format == DEMOSAIC_BGR24 ? 3 : 1;
+}
+
+/* Output layout: pixel x of input line y is stored at origin + x * xstep
+ * + y * ystep.  Steps are the pixel size along output lines, or the pitch
+ * along output columns when rotated.  Planes of planar output are plane
+ * bytes apart. */
+struct demosaic_layout {
+    uint8_t *origin;
+    int xstep;
+    int ystep;
+    enum demosaic_format format;
+    int plane;
+};
+
+static void
+demosaic_layout(struct demosaic_layout *l, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format)
+{
+    int bpp = demosaic_bytes_per_pixel(format);
+    switch (orientation & 3) {
+    case DEMOSAIC_ROTATE_0:
+	l->origin = rgb;
+	l->xstep = bpp;
+	l->ystep = pitch;
+	break;
+    case DEMOSAIC_ROTATE_90:
+	l->origin = rgb + (height - 1) * bpp;
+	l->xstep = pitch;
+	l->ystep = -bpp;
+	break;
+    case DEMOSAIC_ROTATE_180:
+	l->origin = rgb + (height - 1) * pitch + (width - 1) * bpp;
+	l->xstep = -bpp;
+	l->ystep = -pitch;
+	break;
+    case DEMOSAIC_ROTATE_270:
+	l->origin = rgb + (width - 1) * pitch;
+	l->xstep = -pitch;
+	l->ystep = bpp;
+	break;
+    }
+    if (orientation & DEMOSAIC_MIRROR) {
+	l->origin += (width - 1) * l->xstep;
+	l->xstep = -l->xstep;
+    }
+    l->format = format;
+    l->plane = pitch * (orientation & 1 ? width : height);
+}
+
+/* ITU-R BT.601 luma, with weights summing to 256. */
+static inline uint8_t
+demosaic_luma(int b, int g, int r)
+{
+    return (29 * b + 150 * g + 77 * r + 128) >> 8;
+}
+
+/* Store one pixel. */
+static inline void
+demosaic_put(uint8_t *o, enum demosaic_format format, int plane, int b,
+	int g, int r)
+{
+    switch (format) {
+    case DEMOSAIC_BGRA32:
+	o[3] = 255;
+	/* Fall through. */
+    case DEMOSAIC_BGR24:
+	o[0] = b;
+	o[1] = g;
+	o[2] = r;
+	break;
+    case DEMOSAIC_PLANAR:
+	o[0] = r;
+	o[plane] = g;
+	o[2 * plane] = b;
+	break;
+    default:
+	o[0] = demosaic_luma(b, g, r);
+	break;
+    }
+}
+
+static void
+demosaic_copy_pixel(const struct demosaic_layout *l, uint8_t *dst,
+	const uint8_t *src)
+{
+    if (l->format == DEMOSAIC_PLANAR) {
+	for (int p = 0; p < 3; p++)
+	    dst[p * l->plane] = src[p * l->plane];
+    } else {
+	memcpy(dst, src, demosaic_bytes_per_pixel(l->format));
+    }
+}
+
+/* Copy columns x0 to x1 - 1 of an input line to another one, used for
+ * borders. */
+static void
+demosaic_copy_line(const struct demosaic_layout *l, int x0, int x1, int dst,
+	int src)
+{
+    uint8_t *d = l->origin + dst * l->ystep;
+    uint8_t *s = l->origin + src * l->ystep;
+    int bpp = demosaic_bytes_per_pixel(l->format);
+    if (l->xstep == bpp || l->xstep == -bpp) {
+	int offset = (l->xstep < 0 ? x1 - 1 : x0) * l->xstep;
+	int planes = l->format == DEMOSAIC_PLANAR ? 3 : 1;
+	for (int p = 0; p < planes; p++)
+	    memcpy(d + offset + p * l->plane, s + offset + p * l->plane,
+		    (x1 - x0) * bpp);
+    } else {
+	for (int x = x0; x < x1; x++)
+	    demosaic_copy_pixel(l, d + x * l->xstep, s + x * l->xstep);
+    }
+}
+
+/* Size of the level 1 data cache, used to size strips. */
+static int demosaic_cache_size = 32768;
+
+/* Number of columns computed by each strip in tiled variants.  When
+ * rotated, pixels of an input line go to as many output lines, a strip
+ * should cover few enough of them to keep their cache lines, with the input
+ * lines, in half of the cache until the next input line.  Strips are a
+ * multiple of vector width to avoid scalar code at their ends.  Without
+ * rotation, whole lines already fit in cache and are faster to stream. */
+static int
+demosaic_tile(int width, int margin, enum demosaic_orientation orientation,
+	enum demosaic_format format)
+{
+    if (!(orientation & 1))
+	return width;
+    int planes = format == DEMOSAIC_PLANAR ? 3 : 1;
+    int strip = demosaic_cache_size / 2 / (64 * planes + 2 * margin + 1)
+	& ~31;
+    return strip < 32 ? 32 : strip;
+}
+
+/* Split lines in strips computing strip columns, from x0 + margin.  Strips
+ * read margin more columns on each side, so they overlap.  Return the
+ * width of the strip starting at x0 including margins, or 0 after the
+ * last one. */
+static int
+demosaic_strip(int width, int strip, int margin, int x0)
+{
+    if (x0 && x0 + 2 * margin >= width)
+	return 0;
+    return width - x0 < strip + 2 * margin ? width - x0 : strip + 2 * margin;
+}
+
+/* Vector implementations handle the first columns of each line, or of a
+ * strip of width columns, return the column where to continue.  Input
+ * lines are stride bytes apart, pixel x is stored at out + x * xstep. */
+typedef int (*demosaic_line_fn)(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int width, bool blue);
+
+/* Same computation as the reference, for the columns of one line from
+ * x to width - 1, x being odd. */
+static void
+demosaic_line_scalar(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int width, bool blue,
+	int x)
+{
+    const int s = stride;
+    for (; x < width - 1; x += 2) {
+	const uint8_t *p = in + x;
+	uint8_t *o = out + x * l->xstep;
+	if (blue) {
+	    demosaic_put(o, l->format, l->plane,
+		    (p[-1] + p[+1] + 1) >> 1,
+		    p[0],
+		    (p[-s] + p[+s] + 1) >> 1);
+	    p++;
+	    demosaic_put(o + l->xstep, l->format, l->plane,
+		    p[0],
+		    (p[-s] + p[+s] + p[-1] + p[+1] + 2) >> 2,
+		    (p[-s - 1] + p[-s + 1] + p[+s - 1] + p[+s + 1] + 2) >> 2);
+	} else {
+	    demosaic_put(o, l->format, l->plane,
+		    (p[-s - 1] + p[-s + 1] + p[+s - 1] + p[+s + 1] + 2) >> 2,
+		    (p[-s] + p[+s] + p[-1] + p[+1] + 2) >> 2,
+		    p[0]);
+	    p++;
+	    demosaic_put(o + l->xstep, l->format, l->plane,
+		    (p[-s] + p[+s] + 1) >> 1,
+		    p[0],
+		    (p[-1] + p[+1] + 1) >> 1);
+	}
+    }
+}
+
+/* Run a vector implementation on lines y0 to y1 - 1, and fill borders
+ * like the reference does.  The first and last lines are copies of their
+ * neighbours, which must be in the same band.  Lines are processed in
+ * strips of columns, the whole line when strip is at least the width. */
+static void
+demosaic_bilinear_lines(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1, demosaic_line_fn line,
+	int strip)
+{
+    struct demosaic_layout l;
+    demosaic_layout(&l, rgb, pitch, width, height, orientation, format);
+    int w;
+    for (int x0 = 0; (w = demosaic_strip(width, strip, 1, x0));
+	    x0 += w - 2) {
+	bool first = x0 == 0, last = x0 + w == width;
+	for (int y = y0 ? y0 : 1; y < y1 && y < height - 1; y++) {
+	    const uint8_t *in = bayer + y * width + x0;
+	    uint8_t *out = l.origin + y * l.ystep + x0 * l.xstep;
+	    /* Lines with blue pixels are the odd ones. */
+	    bool blue = y & 1;
+	    int x = line(in, out, &l, width, w, blue);
+	    demosaic_line_scalar(in, out, &l, width, w, blue, x);
+	    if (first)
+		demosaic_copy_pixel(&l, out, out + l.xstep);
+	    if (last)
+		demosaic_copy_pixel(&l, out + (w - 1) * l.xstep,
+			out + (w - 2) * l.xstep);
+	    /* Borders while the strip is still in cache. */
+	    if (y == 1 || y == height - 2)
+		demosaic_copy_line(&l, first ? 0 : x0 + 1,
+			last ? width : x0 + w - 1, y == 1 ? 0 : height - 1, y);
+	}
+    }
+}
+
+/* No vector code, everything is done by demosaic_line_scalar. */
+static int
+demosaic_line_none(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int width, bool blue)
+{
+    (void) in;
+    (void) out;
+    (void) l;
+    (void) stride;
+    (void) width;
+    (void) blue;
+    return 1;
+}
+
+static void
+demosaic_band_scalar(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height, orientation,
+	    format, y0, y1, demosaic_line_none, width);
+}
+
+/* Malvar-He-Cutler interpolation: bilinear interpolation corrected with
+ * the gradient of the known color, using 5x5 filters.  With c the center
+ * pixel, h1, v1, h2 and v2 the sums of the pixels at distance 1 and 2 on
+ * the same line or column, and dg the sum of the diagonal neighbours,
+ * filters are, in sixteenths:
+ *  - green at red or blue: 8 c + 4 (h1 + v1) - 2 (h2 + v2),
+ *  - color of horizontal neighbours at green:
+ *    10 c + 8 h1 - 2 h2 - 2 dg + v2,
+ *  - color of vertical neighbours at green:
+ *    10 c + 8 v1 - 2 v2 - 2 dg + h2,
+ *  - red at blue or blue at red: 12 c + 4 dg - 3 (h2 + v2).
+ * Two pixels wide borders use bilinear interpolation. */
+
+static inline uint8_t
+mhc_clamp(int v)
+{
+    v = (v + 8) >> 4;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Bilinear interpolation of a single pixel. */
+static void
+demosaic_pixel_bilinear(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int x, bool blue)
+{
+    const int s = stride;
+    const uint8_t *p = in + x;
+    uint8_t *o = out + x * l->xstep;
+    int lr = (p[-1] + p[+1] + 1) >> 1;
+    int ud = (p[-s] + p[+s] + 1) >> 1;
+    int cross = (p[-s] + p[+s] + p[-1] + p[+1] + 2) >> 2;
+    int diag = (p[-s - 1] + p[-s + 1] + p[+s - 1] + p[+s + 1] + 2) >> 2;
+    bool odd = x & 1;
+    if (blue)
+	demosaic_put(o, l->format, l->plane, odd ? lr : p[0],
+		odd ? p[0] : cross, odd ? ud : diag);
+    else
+	demosaic_put(o, l->format, l->plane, odd ? diag : ud,
+		odd ? cross : p[0], odd ? p[0] : lr);
+}
+
+/* Reference implementation, for columns x to width - 3. */
+static void
+demosaic_mhc_line_scalar(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int width, bool blue,
+	int x)
+{
+    const int s = stride;
+    for (; x < width - 2; x++) {
+	const uint8_t *p = in + x;
+	uint8_t *o = out + x * l->xstep;
+	int c = p[0];
+	int h1 = p[-1] + p[+1];
+	int v1 = p[-s] + p[+s];
+	int h2 = p[-2] + p[+2];
+	int v2 = p[-2 * s] + p[+2 * s];
+	int dg = p[-s - 1] + p[-s + 1] + p[+s - 1] + p[+s + 1];
+	int k1 = 8 * c + 4 * (h1 + v1) - 2 * (h2 + v2);
+	int k2 = 10 * c + 8 * h1 - 2 * h2 - 2 * dg + v2;
+	int k3 = 10 * c + 8 * v1 - 2 * v2 - 2 * dg + h2;
+	int k4 = 12 * c + 4 * dg - 3 * (h2 + v2);
+	bool odd = x & 1;
+	if (blue)
+	    demosaic_put(o, l->format, l->plane, odd ? mhc_clamp(k2) : c,
+		    odd ? c : mhc_clamp(k1),
+		    odd ? mhc_clamp(k3) : mhc_clamp(k4));
+	else
+	    demosaic_put(o, l->format, l->plane,
+		    odd ? mhc_clamp(k4) : mhc_clamp(k3),
+		    odd ? mhc_clamp(k1) : c, odd ? c : mhc_clamp(k2));
+    }
+}
+
+/* Run a vector implementation on lines y0 to y1 - 1, starting at column
+ * 2, then handle borders. */
+static void
+demosaic_mhc_lines(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1, demosaic_line_fn line,
+	int strip)
+{
+    struct demosaic_layout l;
+    demosaic_layout(&l, rgb, pitch, width, height, orientation, format);
+    int w;
+    for (int x0 = 0; (w = demosaic_strip(width, strip, 2, x0));
+	    x0 += w - 4) {
+	bool first = x0 == 0, last = x0 + w == width;
+	for (int y = y0 ? y0 : 1; y < y1 && y < height - 1; y++) {
+	    const uint8_t *in = bayer + y * width + x0;
+	    uint8_t *out = l.origin + y * l.ystep + x0 * l.xstep;
+	    bool blue = y & 1;
+	    if (y == 1 || y == height - 2) {
+		demosaic_line_scalar(in, out, &l, width, w, blue, 1);
+	    } else {
+		int x = line(in, out, &l, width, w, blue);
+		demosaic_mhc_line_scalar(in, out, &l, width, w, blue, x);
+		if (first)
+		    demosaic_pixel_bilinear(in, out, &l, width, 1, blue);
+		if (last)
+		    demosaic_pixel_bilinear(in, out, &l, width, w - 2, blue);
+	    }
+	    if (first)
+		demosaic_copy_pixel(&l, out, out + l.xstep);
+	    if (last)
+		demosaic_copy_pixel(&l, out + (w - 1) * l.xstep,
+			out + (w - 2) * l.xstep);
+	    if (y == 1 || y == height - 2)
+		demosaic_copy_line(&l, first ? 0 : x0 + 2,
+			last ? width : x0 + w - 2, y == 1 ? 0 : height - 1, y);
+	}
+    }
+}
+
+static int
+demosaic_mhc_line_none(const uint8_t *in, uint8_t *out,
+	const struct demosaic_layout *l, int stride, int width, bool blue)
+{
+    (void) in;
+    (void) out;
+    (void) l;
+    (void) stride;
+    (void) width;
+    (void) blue;
+    return 2;
+}
+
+static void
+demosaic_mhc_band_scalar(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_mhc_lines(bayer, rgb, pitch, width, height, orientation, format,
+	    y0, y1, demosaic_mhc_line_none, width);
+}
+
+static void
+demosaic_mhc_scalar(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_mhc_band_scalar(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+#ifdef DEMOSAIC_X86
+
+/* How vector code stores pixels: in order, in reverse order, or one by one
+ * on consecutive output lines when rotated. */
+enum demosaic_store {
+    STORE_FORWARD,
+    STORE_BACKWARD,
+    STORE_SCATTER,
+};
+
+/* Call name_store specialised for a format and each way to store
+ * pixels. */
+#define DEMOSAIC_LINE_STORE(name, format) \
+    do { \
+	const int bpp = format == DEMOSAIC_BGRA32 ? 4 \
+	    : format == DEMOSAIC_BGR24 ? 3 : 1; \
+	if (l->xstep == bpp) \
+	    return name ## _store(in, out, bpp, l->plane, stride, width, \
+		    blue, STORE_FORWARD, format); \
+	else if (l->xstep == -bpp) \
+	    return name ## _store(in, out, -bpp, l->plane, stride, width, \
+		    blue, STORE_BACKWARD, format); \
+	else \
+	    return name ## _store(in, out, l->xstep, l->plane, stride, \
+		    width, blue, STORE_SCATTER, format); \
+    } while (0)
+
+/* Define a line function calling name_store, specialised for each output
+ * format and each way to store pixels. */
+#define DEMOSAIC_LINE(name, isa) \
+__attribute__((target(isa))) \
+static int \
+name(const uint8_t *in, uint8_t *out, const struct demosaic_layout *l, \
+	int stride, int width, bool blue) \
+{ \
+    switch (l->format) { \
+    case DEMOSAIC_BGRA32: \
+	DEMOSAIC_LINE_STORE(name, DEMOSAIC_BGRA32); \
+    case DEMOSAIC_BGR24: \
+	DEMOSAIC_LINE_STORE(name, DEMOSAIC_BGR24); \
+    case DEMOSAIC_PLANAR: \
+	DEMOSAIC_LINE_STORE(name, DEMOSAIC_PLANAR); \
+    default: \
+	DEMOSAIC_LINE_STORE(name, DEMOSAIC_GRAY); \
+    } \
+}
+
+/* Compute (a + b + c + d + 2) >> 2 for each byte. */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_avg4(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    __m128i lo = _mm_add_epi16(
+	    _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+		_mm_unpacklo_epi8(b, zero)),
+	    _mm_add_epi16(_mm_unpacklo_epi8(c, zero),
+		_mm_unpacklo_epi8(d, zero)));
+    __m128i hi = _mm_add_epi16(
+	    _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+		_mm_unpackhi_epi8(b, zero)),
+	    _mm_add_epi16(_mm_unpackhi_epi8(c, zero),
+		_mm_unpackhi_epi8(d, zero)));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+    return _mm_packus_epi16(lo, hi);
+}
+
+/* Take even bytes from a, odd bytes from b. */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_select(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    return _mm_or_si128(_mm_and_si128(even, a), _mm_andnot_si128(even, b));
+}
+
+/* Reverse bytes order. */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_reverse(__m128i v)
+{
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, 0x1b);
+    v = _mm_shufflehi_epi16(v, 0x1b);
+    return _mm_shuffle_epi32(v, 0x4e);
+}
+
+/* Compute luma for each byte. */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_luma(__m128i b, __m128i g, __m128i r)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i kb = _mm_set1_epi16(29);
+    const __m128i kg = _mm_set1_epi16(150);
+    const __m128i kr = _mm_set1_epi16(77);
+    const __m128i half = _mm_set1_epi16(128);
+    __m128i y[2];
+    for (int i = 0; i < 2; i++) {
+	__m128i bw = i ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+	__m128i gw = i ? _mm_unpackhi_epi8(g, zero) : _mm_unpacklo_epi8(g, zero);
+	__m128i rw = i ? _mm_unpackhi_epi8(r, zero) : _mm_unpacklo_epi8(r, zero);
+	/* Sum fits in 16 bit unsigned. */
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(bw, kb),
+		    _mm_mullo_epi16(gw, kg)),
+		_mm_add_epi16(_mm_mullo_epi16(rw, kr), half));
+	y[i] = _mm_srli_epi16(sum, 8);
+    }
+    return _mm_packus_epi16(y[0], y[1]);
+}
+
+/* Store four BGRA pixels as BGR, 12 bytes. */
+__attribute__((target("sse2")))
+static inline void
+sse2_store_bgr(uint8_t *out, __m128i bgra)
+{
+    /* Remove alpha in each 64 bit half, then join halves. */
+    __m128i c = _mm_or_si128(
+	    _mm_and_si128(bgra, _mm_set1_epi64x(0xffffff)),
+	    _mm_and_si128(_mm_srli_epi64(bgra, 8),
+		_mm_set1_epi64x(0xffffff000000)));
+    c = _mm_or_si128(_mm_move_epi64(c),
+	    _mm_slli_si128(_mm_srli_si128(c, 8), 6));
+    _mm_storel_epi64((__m128i *) out, c);
+    uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(c, 8));
+    memcpy(out + 8, &tail, 4);
+}
+
+/* Store 16 pixels, pixel i at out + i * step. */
+__attribute__((target("sse2"), always_inline))
+static inline void
+sse2_store(uint8_t *out, int step, int plane, enum demosaic_store store,
+	enum demosaic_format format, __m128i b, __m128i g, __m128i r)
+{
+    if (store == STORE_BACKWARD) {
+	/* Store in order from the last pixel. */
+	b = sse2_reverse(b);
+	g = sse2_reverse(g);
+	r = sse2_reverse(r);
+	out += 15 * step;
+    } else if (store == STORE_SCATTER) {
+	uint8_t vb[16], vg[16], vr[16];
+	_mm_storeu_si128((__m128i *) vb, b);
+	_mm_storeu_si128((__m128i *) vg, g);
+	_mm_storeu_si128((__m128i *) vr, r);
+	for (int i = 0; i < 16; i++)
+	    demosaic_put(out + i * step, format, plane, vb[i], vg[i], vr[i]);
+	return;
+    }
+    if (format == DEMOSAIC_PLANAR) {
+	_mm_storeu_si128((__m128i *) out, r);
+	_mm_storeu_si128((__m128i *) (out + plane), g);
+	_mm_storeu_si128((__m128i *) (out + 2 * plane), b);
+    } else if (format == DEMOSAIC_GRAY) {
+	_mm_storeu_si128((__m128i *) out, sse2_luma(b, g, r));
+    } else {
+	const __m128i a = _mm_set1_epi8(-1);
+	__m128i bg_lo = _mm_unpacklo_epi8(b, g);
+	__m128i bg_hi = _mm_unpackhi_epi8(b, g);
+	__m128i ra_lo = _mm_unpacklo_epi8(r, a);
+	__m128i ra_hi = _mm_unpackhi_epi8(r, a);
+	__m128i p[4] = {
+	    _mm_unpacklo_epi16(bg_lo, ra_lo), _mm_unpackhi_epi16(bg_lo, ra_lo),
+	    _mm_unpacklo_epi16(bg_hi, ra_hi), _mm_unpackhi_epi16(bg_hi, ra_hi),
+	};
+	for (int i = 0; i < 4; i++) {
+	    if (format == DEMOSAIC_BGRA32)
+		_mm_storeu_si128((__m128i *) (out + i * 16), p[i]);
+	    else
+		sse2_store_bgr(out + i * 12, p[i]);
+	}
+    }
+}
+
+/* Compute 16 pixels at a time.  All interpolations are done for every
+ * pixel, then the right one is selected depending on the column. */
+__attribute__((target("sse2"), always_inline))
+static inline int
+demosaic_line_sse2_store(const uint8_t *in, uint8_t *out, int step,
+	int plane, int stride, int width, bool blue,
+	enum demosaic_store store, enum demosaic_format format)
+{
+    const int s = stride;
+    int x;
+    for (x = 1; x + 16 < width; x += 16) {
+	const uint8_t *p = in + x;
+#define LOAD(o) _mm_loadu_si128((const __m128i *) (p + (o)))
+	__m128i c = LOAD(0);
+	__m128i l = LOAD(-1), r = LOAD(+1);
+	__m128i u = LOAD(-s), d = LOAD(+s);
+	__m128i lr = _mm_avg_epu8(l, r);
+	__m128i ud = _mm_avg_epu8(u, d);
+	__m128i cross = sse2_avg4(u, d, l, r);
+	__m128i diag = sse2_avg4(LOAD(-s - 1), LOAD(-s + 1), LOAD(+s - 1),
+		LOAD(+s + 1));
+#undef LOAD
+	if (blue)
+	    sse2_store(out + x * step, step, plane, store, format,
+		    sse2_select(lr, c), sse2_select(c, cross),
+		    sse2_select(ud, diag));
+	else
+	    sse2_store(out + x * step, step, plane, store, format,
+		    sse2_select(diag, ud), sse2_select(cross, c),
+		    sse2_select(c, lr));
+    }
+    return x;
+}
+
+DEMOSAIC_LINE(demosaic_line_sse2, "sse2")
+
+static void
+demosaic_bilinear_sse2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height,
+	    demosaic_line_sse2, width);
+}
+
+static void
+demosaic_band_sse2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height, orientation,
+	    format, y0, y1, demosaic_line_sse2, width);
+}
+
+static void
+demosaic_band_sse2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    int strip = demosaic_tile(width, 1, orientation, format);
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height, orientation,
+	    format, y0, y1, demosaic_line_sse2, strip);
+}
+
+static void
+demosaic_bilinear_sse2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_band_sse2_tiled(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_avg4(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i two = _mm256_set1_epi16(2);
+    __m256i lo = _mm256_add_epi16(
+	    _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+		_mm256_unpacklo_epi8(b, zero)),
+	    _mm256_add_epi16(_mm256_unpacklo_epi8(c, zero),
+		_mm256_unpacklo_epi8(d, zero)));
+    __m256i hi = _mm256_add_epi16(
+	    _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+		_mm256_unpackhi_epi8(b, zero)),
+	    _mm256_add_epi16(_mm256_unpackhi_epi8(c, zero),
+		_mm256_unpackhi_epi8(d, zero)));
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+    /* Unpack and pack both work inside 128 bit lanes, order is kept. */
+    return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_select(__m256i a, __m256i b)
+{
+    const __m256i even = _mm256_set1_epi16(0x00ff);
+    return _mm256_blendv_epi8(b, a, even);
+}
+
+/* Reverse bytes order, inside lanes then swap lanes. */
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_reverse(__m256i v)
+{
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+	    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4,
+	    3, 2, 1, 0);
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, reverse), 0x4e);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_luma(__m256i b, __m256i g, __m256i r)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i kb = _mm256_set1_epi16(29);
+    const __m256i kg = _mm256_set1_epi16(150);
+    const __m256i kr = _mm256_set1_epi16(77);
+    const __m256i half = _mm256_set1_epi16(128);
+    __m256i y[2];
+    for (int i = 0; i < 2; i++) {
+	__m256i bw = i ? _mm256_unpackhi_epi8(b, zero)
+	    : _mm256_unpacklo_epi8(b, zero);
+	__m256i gw = i ? _mm256_unpackhi_epi8(g, zero)
+	    : _mm256_unpacklo_epi8(g, zero);
+	__m256i rw = i ? _mm256_unpackhi_epi8(r, zero)
+	    : _mm256_unpacklo_epi8(r, zero);
+	__m256i sum = _mm256_add_epi16(
+		_mm256_add_epi16(_mm256_mullo_epi16(bw, kb),
+		    _mm256_mullo_epi16(gw, kg)),
+		_mm256_add_epi16(_mm256_mullo_epi16(rw, kr), half));
+	y[i] = _mm256_srli_epi16(sum, 8);
+    }
+    /* Unpack and pack both work inside 128 bit lanes, order is kept. */
+    return _mm256_packus_epi16(y[0], y[1]);
+}
+
+/* Store 32 pixels.  For packed formats, unpack works inside 128 bit lanes,
+ * quadwords are reordered first so that pixels come out in order. */
+__attribute__((target("avx2"), always_inline))
+static inline void
+avx2_store(uint8_t *out, int step, int plane, enum demosaic_store store,
+	enum demosaic_format format, __m256i b, __m256i g, __m256i r)
+{
+    if (store == STORE_BACKWARD) {
+	b = avx2_reverse(b);
+	g = avx2_reverse(g);
+	r = avx2_reverse(r);
+	out += 31 * step;
+    } else if (store == STORE_SCATTER) {
+	uint8_t vb[32], vg[32], vr[32];
+	_mm256_storeu_si256((__m256i *) vb, b);
+	_mm256_storeu_si256((__m256i *) vg, g);
+	_mm256_storeu_si256((__m256i *) vr, r);
+	for (int i = 0; i < 32; i++)
+	    demosaic_put(out + i * step, format, plane, vb[i], vg[i], vr[i]);
+	return;
+    }
+    if (format == DEMOSAIC_PLANAR) {
+	_mm256_storeu_si256((__m256i *) out, r);
+	_mm256_storeu_si256((__m256i *) (out + plane), g);
+	_mm256_storeu_si256((__m256i *) (out + 2 * plane), b);
+	return;
+    } else if (format == DEMOSAIC_GRAY) {
+	_mm256_storeu_si256((__m256i *) out, avx2_luma(b, g, r));
+	return;
+    }
+    const __m256i a = _mm256_set1_epi8(-1);
+    b = _mm256_permute4x64_epi64(b, 0xd8);
+    g = _mm256_permute4x64_epi64(g, 0xd8);
+    r = _mm256_permute4x64_epi64(r, 0xd8);
+    /* Pixels 0-15 and 16-31. */
+    __m256i bg_lo = _mm256_unpacklo_epi8(b, g);
+    __m256i bg_hi = _mm256_unpackhi_epi8(b, g);
+    __m256i ra_lo = _mm256_unpacklo_epi8(r, a);
+    __m256i ra_hi = _mm256_unpackhi_epi8(r, a);
+    /* Pixels 0-3 and 8-11, 4-7 and 12-15... */
+    __m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+    __m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+    __m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+    __m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+    __m256i q[4] = {
+	_mm256_permute2x128_si256(p0, p1, 0x20),
+	_mm256_permute2x128_si256(p0, p1, 0x31),
+	_mm256_permute2x128_si256(p2, p3, 0x20),
+	_mm256_permute2x128_si256(p2, p3, 0x31),
+    };
+    if (format == DEMOSAIC_BGRA32) {
+	for (int i = 0; i < 4; i++)
+	    _mm256_storeu_si256((__m256i *) (out + i * 32), q[i]);
+    } else {
+	/* Remove alpha in each lane, then move the 24 used bytes first.
+	 * Stores overlap, the unused part is overwritten by the next one,
+	 * the last one is split not to write after the last pixel. */
+	const __m256i bgr = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+		13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+		-1, -1, -1, -1);
+	const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	for (int i = 0; i < 4; i++)
+	    q[i] = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(q[i], bgr),
+		    join);
+	for (int i = 0; i < 3; i++)
+	    _mm256_storeu_si256((__m256i *) (out + i * 24), q[i]);
+	_mm_storeu_si128((__m128i *) (out + 72), _mm256_castsi256_si128(q[3]));
+	_mm_storel_epi64((__m128i *) (out + 88),
+		_mm256_extracti128_si256(q[3], 1));
+    }
+}
+
+/* Same as the SSE2 version, 32 pixels at a time. */
+__attribute__((target("avx2"), always_inline))
+static inline int
+demosaic_line_avx2_store(const uint8_t *in, uint8_t *out, int step,
+	int plane, int stride, int width, bool blue,
+	enum demosaic_store store, enum demosaic_format format)
+{
+    const int s = stride;
+    int x;
+    for (x = 1; x + 32 < width; x += 32) {
+	const uint8_t *p = in + x;
+#define LOAD(o) _mm256_loadu_si256((const __m256i *) (p + (o)))
+	__m256i c = LOAD(0);
+	__m256i l = LOAD(-1), r = LOAD(+1);
+	__m256i u = LOAD(-s), d = LOAD(+s);
+	__m256i lr = _mm256_avg_epu8(l, r);
+	__m256i ud = _mm256_avg_epu8(u, d);
+	__m256i cross = avx2_avg4(u, d, l, r);
+	__m256i diag = avx2_avg4(LOAD(-s - 1), LOAD(-s + 1), LOAD(+s - 1),
+		LOAD(+s + 1));
+#undef LOAD
+	if (blue)
+	    avx2_store(out + x * step, step, plane, store, format,
+		    avx2_select(lr, c), avx2_select(c, cross),
+		    avx2_select(ud, diag));
+	else
+	    avx2_store(out + x * step, step, plane, store, format,
+		    avx2_select(diag, ud), avx2_select(cross, c),
+		    avx2_select(c, lr));
+    }
+    return x;
+}
+
+DEMOSAIC_LINE(demosaic_line_avx2, "avx2")
+
+static void
+demosaic_bilinear_avx2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height,
+	    demosaic_line_avx2, width);
+}
+
+static void
+demosaic_band_avx2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height, orientation,
+	    format, y0, y1, demosaic_line_avx2, width);
+}
+
+static void
+demosaic_band_avx2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    int strip = demosaic_tile(width, 1, orientation, format);
+    demosaic_bilinear_lines(bayer, rgb, pitch, width, height, orientation,
+	    format, y0, y1, demosaic_line_avx2, strip);
+}
+
+static void
+demosaic_bilinear_avx2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_band_avx2_tiled(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+/* Offsets of the pixels used by MHC filters: center, left, right, up and
+ * down at distance 1 and 2, then diagonals. */
+#define MHC_OFFSETS(s) { 0, -1, +1, -(s), +(s), -2, +2, -2 * (s), \
+    +2 * (s), -(s) - 1, -(s) + 1, +(s) - 1, +(s) + 1 }
+
+/* Compute the four MHC filters on 16 bit values, from the low or high
+ * half of the loaded pixels. */
+__attribute__((target("sse2")))
+static inline void
+sse2_mhc_half(const __m128i *v, bool high, __m128i k[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i w[13];
+    for (int i = 0; i < 13; i++)
+	w[i] = high ? _mm_unpackhi_epi8(v[i], zero)
+	    : _mm_unpacklo_epi8(v[i], zero);
+    __m128i c = w[0];
+    __m128i h1 = _mm_add_epi16(w[1], w[2]);
+    __m128i v1 = _mm_add_epi16(w[3], w[4]);
+    __m128i h2 = _mm_add_epi16(w[5], w[6]);
+    __m128i v2 = _mm_add_epi16(w[7], w[8]);
+    __m128i dg = _mm_add_epi16(_mm_add_epi16(w[9], w[10]),
+	    _mm_add_epi16(w[11], w[12]));
+    __m128i c8 = _mm_slli_epi16(c, 3);
+    __m128i c10 = _mm_add_epi16(c8, _mm_slli_epi16(c, 1));
+    __m128i c12 = _mm_add_epi16(c8, _mm_slli_epi16(c, 2));
+    __m128i hv2 = _mm_add_epi16(h2, v2);
+    __m128i dg2 = _mm_slli_epi16(dg, 1);
+    k[0] = _mm_sub_epi16(_mm_add_epi16(c8,
+		_mm_slli_epi16(_mm_add_epi16(h1, v1), 2)),
+	    _mm_slli_epi16(hv2, 1));
+    k[1] = _mm_add_epi16(_mm_sub_epi16(_mm_add_epi16(c10,
+		    _mm_slli_epi16(h1, 3)),
+		_mm_add_epi16(_mm_slli_epi16(h2, 1), dg2)), v2);
+    k[2] = _mm_add_epi16(_mm_sub_epi16(_mm_add_epi16(c10,
+		    _mm_slli_epi16(v1, 3)),
+		_mm_add_epi16(_mm_slli_epi16(v2, 1), dg2)), h2);
+    k[3] = _mm_sub_epi16(_mm_add_epi16(c12, _mm_slli_epi16(dg, 2)),
+	    _mm_add_epi16(hv2, _mm_slli_epi16(hv2, 1)));
+    const __m128i eight = _mm_set1_epi16(8);
+    for (int i = 0; i < 4; i++)
+	k[i] = _mm_srai_epi16(_mm_add_epi16(k[i], eight), 4);
+}
+
+/* Compute 16 pixels at a time, starting at an even column. */
+__attribute__((target("sse2"), always_inline))
+static inline int
+demosaic_mhc_line_sse2_store(const uint8_t *in, uint8_t *out, int step,
+	int plane, int stride, int width, bool blue,
+	enum demosaic_store store, enum demosaic_format format)
+{
+    const int offsets[13] = MHC_OFFSETS(stride);
+    int x;
+    for (x = 2; x + 18 <= width; x += 16) {
+	__m128i v[13], lo[4], hi[4], k[4];
+	for (int i = 0; i < 13; i++)
+	    v[i] = _mm_loadu_si128((const __m128i *) (in + x + offsets[i]));
+	sse2_mhc_half(v, false, lo);
+	sse2_mhc_half(v, true, hi);
+	for (int i = 0; i < 4; i++)
+	    k[i] = _mm_packus_epi16(lo[i], hi[i]);
+	__m128i c = v[0];
+	if (blue)
+	    sse2_store(out + x * step, step, plane, store, format,
+		    sse2_select(c, k[1]), sse2_select(k[0], c),
+		    sse2_select(k[3], k[2]));
+	else
+	    sse2_store(out + x * step, step, plane, store, format,
+		    sse2_select(k[2], k[3]), sse2_select(c, k[0]),
+		    sse2_select(k[1], c));
+    }
+    return x;
+}
+
+DEMOSAIC_LINE(demosaic_mhc_line_sse2, "sse2")
+
+static void
+demosaic_mhc_band_sse2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_mhc_lines(bayer, rgb, pitch, width, height, orientation, format,
+	    y0, y1, demosaic_mhc_line_sse2, width);
+}
+
+static void
+demosaic_mhc_band_sse2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    int strip = demosaic_tile(width, 2, orientation, format);
+    demosaic_mhc_lines(bayer, rgb, pitch, width, height, orientation, format,
+	    y0, y1, demosaic_mhc_line_sse2, strip);
+}
+
+static void
+demosaic_mhc_sse2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_mhc_band_sse2_tiled(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+static void
+demosaic_mhc_sse2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_mhc_band_sse2(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+__attribute__((target("avx2")))
+static inline void
+avx2_mhc_half(const __m256i *v, bool high, __m256i k[4])
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i w[13];
+    for (int i = 0; i < 13; i++)
+	w[i] = high ? _mm256_unpackhi_epi8(v[i], zero)
+	    : _mm256_unpacklo_epi8(v[i], zero);
+    __m256i c = w[0];
+    __m256i h1 = _mm256_add_epi16(w[1], w[2]);
+    __m256i v1 = _mm256_add_epi16(w[3], w[4]);
+    __m256i h2 = _mm256_add_epi16(w[5], w[6]);
+    __m256i v2 = _mm256_add_epi16(w[7], w[8]);
+    __m256i dg = _mm256_add_epi16(_mm256_add_epi16(w[9], w[10]),
+	    _mm256_add_epi16(w[11], w[12]));
+    __m256i c8 = _mm256_slli_epi16(c, 3);
+    __m256i c10 = _mm256_add_epi16(c8, _mm256_slli_epi16(c, 1));
+    __m256i c12 = _mm256_add_epi16(c8, _mm256_slli_epi16(c, 2));
+    __m256i hv2 = _mm256_add_epi16(h2, v2);
+    __m256i dg2 = _mm256_slli_epi16(dg, 1);
+    k[0] = _mm256_sub_epi16(_mm256_add_epi16(c8,
+		_mm256_slli_epi16(_mm256_add_epi16(h1, v1), 2)),
+	    _mm256_slli_epi16(hv2, 1));
+    k[1] = _mm256_add_epi16(_mm256_sub_epi16(_mm256_add_epi16(c10,
+		    _mm256_slli_epi16(h1, 3)),
+		_mm256_add_epi16(_mm256_slli_epi16(h2, 1), dg2)), v2);
+    k[2] = _mm256_add_epi16(_mm256_sub_epi16(_mm256_add_epi16(c10,
+		    _mm256_slli_epi16(v1, 3)),
+		_mm256_add_epi16(_mm256_slli_epi16(v2, 1), dg2)), h2);
+    k[3] = _mm256_sub_epi16(_mm256_add_epi16(c12, _mm256_slli_epi16(dg, 2)),
+	    _mm256_add_epi16(hv2, _mm256_slli_epi16(hv2, 1)));
+    const __m256i eight = _mm256_set1_epi16(8);
+    for (int i = 0; i < 4; i++)
+	k[i] = _mm256_srai_epi16(_mm256_add_epi16(k[i], eight), 4);
+}
+
+/* Same as the SSE2 version, 32 pixels at a time. */
+__attribute__((target("avx2"), always_inline))
+static inline int
+demosaic_mhc_line_avx2_store(const uint8_t *in, uint8_t *out, int step,
+	int plane, int stride, int width, bool blue,
+	enum demosaic_store store, enum demosaic_format format)
+{
+    const int offsets[13] = MHC_OFFSETS(stride);
+    int x;
+    for (x = 2; x + 34 <= width; x += 32) {
+	__m256i v[13], lo[4], hi[4], k[4];
+	for (int i = 0; i < 13; i++)
+	    v[i] = _mm256_loadu_si256((const __m256i *) (in + x + offsets[i]));
+	avx2_mhc_half(v, false, lo);
+	avx2_mhc_half(v, true, hi);
+	for (int i = 0; i < 4; i++)
+	    k[i] = _mm256_packus_epi16(lo[i], hi[i]);
+	__m256i c = v[0];
+	if (blue)
+	    avx2_store(out + x * step, step, plane, store, format,
+		    avx2_select(c, k[1]), avx2_select(k[0], c),
+		    avx2_select(k[3], k[2]));
+	else
+	    avx2_store(out + x * step, step, plane, store, format,
+		    avx2_select(k[2], k[3]), avx2_select(c, k[0]),
+		    avx2_select(k[1], c));
+    }
+    return x;
+}
+
+DEMOSAIC_LINE(demosaic_mhc_line_avx2, "avx2")
+
+static void
+demosaic_mhc_band_avx2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    demosaic_mhc_lines(bayer, rgb, pitch, width, height, orientation, format,
+	    y0, y1, demosaic_mhc_line_avx2, width);
+}
+
+static void
+demosaic_mhc_band_avx2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, int y0, int y1)
+{
+    int strip = demosaic_tile(width, 2, orientation, format);
+    demosaic_mhc_lines(bayer, rgb, pitch, width, height, orientation, format,
+	    y0, y1, demosaic_mhc_line_avx2, strip);
+}
+
+static void
+demosaic_mhc_avx2_tiled(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_mhc_band_avx2_tiled(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+static void
+demosaic_mhc_avx2(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height)
+{
+    demosaic_mhc_band_avx2(bayer, rgb, pitch, width, height,
+	    DEMOSAIC_ROTATE_0, DEMOSAIC_BGRA32, 0, height);
+}
+
+#undef DEMOSAIC_LINE
+
+#endif /* DEMOSAIC_X86 */
+
+static struct demosaic_variant variants[DEMOSAIC_METHODS_NB][5];
+static int variants_nb[DEMOSAIC_METHODS_NB];
+static pthread_once_t variants_once = PTHREAD_ONCE_INIT;
+
+#define VARIANT(method, name, fn, band) \
+    variants[method][variants_nb[method]++] = \
+	(struct demosaic_variant) { name, fn, band }
+
+static void
+demosaic_init(void)
+{
+    VARIANT(DEMOSAIC_BILINEAR, "scalar", demosaic_bilinear_scalar,
+	    demosaic_band_scalar);
+    VARIANT(DEMOSAIC_MHC, "scalar", demosaic_mhc_scalar,
+	    demosaic_mhc_band_scalar);
+#ifdef DEMOSAIC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+	VARIANT(DEMOSAIC_BILINEAR, "sse2", demosaic_bilinear_sse2,
+		demosaic_band_sse2);
+	VARIANT(DEMOSAIC_BILINEAR, "sse2-tiled", demosaic_bilinear_sse2_tiled,
+		demosaic_band_sse2_tiled);
+	VARIANT(DEMOSAIC_MHC, "sse2", demosaic_mhc_sse2,
+		demosaic_mhc_band_sse2);
+	VARIANT(DEMOSAIC_MHC, "sse2-tiled", demosaic_mhc_sse2_tiled,
+		demosaic_mhc_band_sse2_tiled);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	VARIANT(DEMOSAIC_BILINEAR, "avx2", demosaic_bilinear_avx2,
+		demosaic_band_avx2);
+	VARIANT(DEMOSAIC_BILINEAR, "avx2-tiled", demosaic_bilinear_avx2_tiled,
+		demosaic_band_avx2_tiled);
+	VARIANT(DEMOSAIC_MHC, "avx2", demosaic_mhc_avx2,
+		demosaic_mhc_band_avx2);
+	VARIANT(DEMOSAIC_MHC, "avx2-tiled", demosaic_mhc_avx2_tiled,
+		demosaic_mhc_band_avx2_tiled);
+    }
+#endif
+    long cache_size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    if (cache_size > 0)
+	demosaic_cache_size = cache_size;
+}
+
+#undef VARIANT
+
+const struct demosaic_variant *
+demosaic_variants(enum demosaic_method method, int *n)
+{
+    pthread_once(&variants_once, demosaic_init);
+    *n = variants_nb[method];
+    return variants[method];
+}
+
+void
+demosaic_output_size(enum demosaic_orientation orientation, int width,
+	int height, int *out_width, int *out_height)
+{
+    bool swap = orientation & 1;
+    *out_width = swap ? height : width;
+    *out_height = swap ? width : height;
+}
+
+/* Preview, specialised for each format. */
+static inline __attribute__((always_inline)) void
+demosaic_superpixel_format(const uint8_t *bayer, int width, int height,
+	const struct demosaic_layout *l, enum demosaic_format format)
+{
+    for (int y = 0; y < height - 1; y += 2) {
+	const uint8_t *in = bayer + y * width;
+	uint8_t *out = l->origin + y / 2 * l->ystep;
+	for (int x = 0; x < width - 1; x += 2) {
+	    demosaic_put(out, format, l->plane,
+		    in[x + width],
+		    (in[x] + in[x + width + 1] + 1) >> 1,
+		    in[x + 1]);
+	    out += l->xstep;
+	}
+    }
+}
+
+void
+demosaic_superpixel(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format)
+{
+    struct demosaic_layout l;
+    demosaic_layout(&l, rgb, pitch, width / 2, height / 2, orientation,
+	    format);
+    switch (format) {
+    case DEMOSAIC_BGRA32:
+	demosaic_superpixel_format(bayer, width, height, &l, DEMOSAIC_BGRA32);
+	break;
+    case DEMOSAIC_BGR24:
+	demosaic_superpixel_format(bayer, width, height, &l, DEMOSAIC_BGR24);
+	break;
+    case DEMOSAIC_PLANAR:
+	demosaic_superpixel_format(bayer, width, height, &l, DEMOSAIC_PLANAR);
+	break;
+    default:
+	demosaic_superpixel_format(bayer, width, height, &l, DEMOSAIC_GRAY);
+	break;
+    }
+}
+
+/* Job given to workers. */
+struct demosaic_job {
+    const struct demosaic_variant *variant;
+    const uint8_t *bayer;
+    uint8_t *rgb;
+    int pitch;
+    int width;
+    int height;
+    enum demosaic_orientation orientation;
+    enum demosaic_format format;
+    int y0;
+    int y1;
+};
+
+/* Convert one band, bands limits are even so that the first two lines
+ * and the last two lines are never split. */
+static void
+demosaic_job_band(void *arg, int index, int count)
+{
+    struct demosaic_job *job = arg;
+    int lines = job->y1 - job->y0;
+    int y0 = job->y0 + (lines * index / count & ~1);
+    int y1 = index + 1 == count ? job->y1
+	: job->y0 + (lines * (index + 1) / count & ~1);
+    if (y0 < y1)
+	job->variant->band(job->bayer, job->rgb, job->pitch, job->width,
+		job->height, job->orientation, job->format, y0, y1);
+}
+
+void
+demosaic_run(struct workers *workers, const struct demosaic_variant *variant,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format)
+{
+    struct demosaic_job job = { variant, bayer, rgb, pitch, width, height,
+	orientation, format, 0, height };
+    workers_run(workers, demosaic_job_band, &job);
+}
+
+void
+demosaic_convert(struct workers *workers, enum demosaic_method method,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format)
+{
+    int n;
+    const struct demosaic_variant *variants = demosaic_variants(method, &n);
+    demosaic_run(workers, &variants[n - 1], bayer, rgb, pitch, width, height,
+	    orientation, format);
+}
+
+void
+demosaic_convert_lines(struct workers *workers, enum demosaic_method method,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	int y0, int y1)
+{
+    assert(!(orientation & 1) && format != DEMOSAIC_PLANAR);
+    assert(!(y0 & 1) && (!(y1 & 1) || y1 == height));
+    int n;
+    const struct demosaic_variant *variants = demosaic_variants(method, &n);
+    /* Move the image origin so that the first output line of the band
+     * lands at the start of the buffer, only lines of the band are
+     * written. */
+    int first = orientation & DEMOSAIC_ROTATE_180 ? height - y1 : y0;
+    struct demosaic_job job = { &variants[n - 1], bayer, rgb - first * pitch,
+	pitch, width, height, orientation, format, y0, y1 };
+    workers_run(workers, demosaic_job_band, &job);
+}
@@ -0,0 +1,140 @@
+#ifndef demosaic_h
+#define demosaic_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdint.h>
+
+#include "workers.h"
+
+/* Bayer demosaicing.
+ *
+ * Images from the sensor use a GRBG pattern, they are converted to BGRA,
+ * or to a smaller format when alpha or colors are not needed.  For each
+ * method, several implementations give exactly the same result, the
+ * fastest one supported by the CPU is used.  Images can be split in
+ * horizontal bands, converted in parallel.  Tiled implementations process
+ * bands in strips of columns sized for the cache when output is rotated. */
+
+/* Demosaicing methods. */
+enum demosaic_method {
+    /* Average of neighbours. */
+    DEMOSAIC_BILINEAR,
+    /* Malvar-He-Cutler gradient corrected interpolation, slower, with
+     * less artifacts on edges. */
+    DEMOSAIC_MHC,
+    DEMOSAIC_METHODS_NB
+};
+
+/* Output orientation, rotation is clockwise.  Mirroring swaps left and
+ * right before rotation. */
+enum demosaic_orientation {
+    DEMOSAIC_ROTATE_0,
+    DEMOSAIC_ROTATE_90,
+    DEMOSAIC_ROTATE_180,
+    DEMOSAIC_ROTATE_270,
+    /* Flag, can be combined with a rotation. */
+    DEMOSAIC_MIRROR = 4,
+    DEMOSAIC_ORIENTATIONS_NB = 8
+};
+
+/* Output formats. */
+enum demosaic_format {
+    /* Bytes B, G, R and A, always 255. */
+    DEMOSAIC_BGRA32,
+    /* Bytes B, G and R. */
+    DEMOSAIC_BGR24,
+    /* One byte per pixel in three planes, R, G and B.  Each plane is
+     * pitch * output height bytes long. */
+    DEMOSAIC_PLANAR,
+    /* One byte of luma. */
+    DEMOSAIC_GRAY,
+};
+
+/* Convert a GRBG Bayer image to BGRA, without rotation.  Output lines
+ * start every pitch bytes, which can be more than width * 4, for example
+ * to write directly to a texture. */
+typedef void (*demosaic_fn)(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height);
+
+/* Same, only for input lines y0 to y1 - 1, written with the given
+ * orientation and format, directly at their final place.  The line before
+ * and after the band are read. */
+typedef void (*demosaic_band_fn)(const uint8_t *bayer, uint8_t *rgb,
+	int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	int y0, int y1);
+
+/* Implementation of a demosaicing algorithm. */
+struct demosaic_variant {
+    const char *name;
+    demosaic_fn fn;
+    demosaic_band_fn band;
+};
+
+/* Return the implementations of a method supported by the CPU, the first
+ * one is the reference, the last one is the fastest.  Set n to their
+ * number. */
+const struct demosaic_variant *
+demosaic_variants(enum demosaic_method method, int *n);
+
+/* Return the size of a pixel in bytes, in each plane for planar output. */
+int
+demosaic_bytes_per_pixel(enum demosaic_format format);
+
+/* Give output image size for an orientation, width and height are
+ * swapped by quarter turns. */
+void
+demosaic_output_size(enum demosaic_orientation orientation, int width,
+	int height, int *out_width, int *out_height);
+
+/* Convert using the given implementation, one band per worker. */
+void
+demosaic_run(struct workers *workers, const struct demosaic_variant *variant,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format);
+
+/* Convert using the fastest implementation of a method, one band per
+ * worker. */
+void
+demosaic_convert(struct workers *workers, enum demosaic_method method,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format);
+
+/* Same, only for input lines y0 to y1 - 1, to a buffer holding only
+ * their output lines, for example to stream an image a few lines at a
+ * time.  Quarter turns and planar output are not supported.  Band limits
+ * must be even, except at the image end. */
+void
+demosaic_convert_lines(struct workers *workers, enum demosaic_method method,
+	const uint8_t *bayer, uint8_t *rgb, int pitch, int width, int height,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	int y0, int y1);
+
+/* Convert each 2x2 cell to one pixel, for a fast preview.  Output is
+ * width / 2 x height / 2 before orientation. */
+void
+demosaic_superpixel(const uint8_t *bayer, uint8_t *rgb, int pitch,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format);
+
+#endif /* demosaic_h */
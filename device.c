@@ -0,0 +1,305 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "device.h"
+
+#define ID_VENDOR 0x232f
+#define ID_PRODUCT 0x0100
+
+static void
+device_get_location(libusb_device *device, struct device_location *location)
+{
+    location->bus = libusb_get_bus_number(device);
+    int r = libusb_get_port_numbers(device, location->ports,
+	    DEVICE_PORTS_MAX);
+    location->ports_nb = r < 0 ? 0 : r;
+}
+
+bool
+device_location_equal(const struct device_location *a,
+	const struct device_location *b)
+{
+    return a->bus == b->bus && a->ports_nb == b->ports_nb
+	&& memcmp(a->ports, b->ports, a->ports_nb) == 0;
+}
+
+bool
+device_location_parse(const char *str, struct device_location *location)
+{
+    char *tail;
+    errno = 0;
+    unsigned long n = strtoul(str, &tail, 10);
+    if (errno || tail == str || *tail != '-' || n > 255)
+	return false;
+    location->bus = n;
+    location->ports_nb = 0;
+    do {
+	str = tail + 1;
+	n = strtoul(str, &tail, 10);
+	if (errno || tail == str || n > 255
+		|| location->ports_nb == DEVICE_PORTS_MAX)
+	    return false;
+	location->ports[location->ports_nb++] = n;
+    } while (*tail == '.');
+    return *tail == '\0';
+}
+
+void
+device_location_format(const struct device_location *location, char *buf,
+	int size)
+{
+    int n = snprintf(buf, size, "%d-", location->bus);
+    for (int i = 0; i < location->ports_nb && n < size; i++)
+	n += snprintf(buf + n, size - n, i ? ".%d" : "%d",
+		location->ports[i]);
+}
+
+int
+device_list(libusb_context *usb, struct device_location *locations,
+	int locations_size)
+{
+    libusb_device **list;
+    int found = 0;
+    ssize_t cnt = libusb_get_device_list(usb, &list);
+    if (cnt < 0)
+	error(EXIT_FAILURE, 0, "can not list devices: %s",
+		libusb_strerror(cnt));
+    for (ssize_t i = 0; i < cnt && found < locations_size; i++) {
+	libusb_device *device = list[i];
+	struct libusb_device_descriptor desc;
+	int r = libusb_get_device_descriptor(device, &desc);
+	if (r)
+	    error(EXIT_FAILURE, 0, "can not get device descriptor: %s",
+		    libusb_strerror(r));
+	if (desc.idVendor == ID_VENDOR && desc.idProduct == ID_PRODUCT)
+	    device_get_location(device, &locations[found++]);
+    }
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+libusb_device_handle *
+device_open(libusb_context *usb, const struct device_location *location)
+{
+    libusb_device **list;
+    libusb_device *found = NULL;
+    ssize_t cnt = libusb_get_device_list(usb, &list);
+    if (cnt < 0)
+	error(EXIT_FAILURE, 0, "can not list devices: %s",
+		libusb_strerror(cnt));
+    for (ssize_t i = 0; i < cnt && !found; i++) {
+	libusb_device *device = list[i];
+	struct libusb_device_descriptor desc;
+	int r = libusb_get_device_descriptor(device, &desc);
+	if (r)
+	    error(EXIT_FAILURE, 0, "can not get device descriptor: %s",
+		    libusb_strerror(r));
+	if (desc.idVendor == ID_VENDOR && desc.idProduct == ID_PRODUCT) {
+	    struct device_location device_location;
+	    device_get_location(device, &device_location);
+	    if (device_location_equal(location, &device_location))
+		found = device;
+	}
+    }
+    libusb_device_handle *handle = NULL;
+    if (found) {
+	int r = libusb_open(found, &handle);
+	if (r) {
+	    error(0, 0, "can not open device: %s", libusb_strerror(r));
+	    handle = NULL;
+	}
+    }
+    libusb_free_device_list(list, 1);
+    return handle;
+}
+
+bool
+device_hotplug_register(libusb_context *usb, libusb_hotplug_callback_fn cb,
+	void *user_data, libusb_hotplug_callback_handle *handle)
+{
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	return false;
+    int r = libusb_hotplug_register_callback(usb,
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+	    | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+	    ID_VENDOR, ID_PRODUCT, LIBUSB_HOTPLUG_MATCH_ANY, cb, user_data,
+	    handle);
+    if (r)
+	error(EXIT_FAILURE, 0, "can not register hotplug callback: %s",
+		libusb_strerror(r));
+    return true;
+}
+
+static int
+device_reset(struct regs *regs)
+{
+    regs_write(regs, 0x00, 0x0000);
+    int r = regs_flush(regs);
+    if (r)
+	return r;
+    regs_write(regs, 0x00, 0x0001);
+    r = regs_flush(regs);
+    /* Registers are back to their default values. */
+    regs_invalidate(regs);
+    return r;
+}
+
+static void
+device_queue_gain(struct regs *regs, double gain)
+{
+    double gmin, gmax;
+    int xmin, xmax;
+    bool up = false;
+    if (gain <= 1.34) {
+	gmin = 0.33;
+	gmax = 1.33;
+	xmin = 0x08;
+	xmax = 0x20;
+    } else if (gain <= 2.68) {
+	gmin = 1.42;
+	gmax = 2.67;
+	xmin = 0x51;
+	xmax = 0x60;
+    } else {
+	gmin = 3;
+	gmax = 42.67;
+	xmin = 0x1;
+	xmax = 0x78;
+	up = true;
+    }
+    int x = (gain - gmin) / (gmax - gmin) * (xmax - xmin) + xmin;
+    if (x < xmin)
+	x = xmin;
+    else if (x > xmax)
+	x = xmax;
+    if (up)
+	x = (x << 8) | 0x60;
+    /* Green1, blue, red and green2 gains, sent in one transfer. */
+    const uint16_t gains[] = { x, x, x, x };
+    regs_write_burst(regs, 0x2b, gains, 4);
+}
+
+static void
+device_queue_exposure(struct regs *regs, double exposure)
+{
+    int exposure_w = exposure * 12.82;
+    if (exposure_w < 0x000c)
+	exposure_w = 0x000c;
+    else if (exposure_w > 0xffff)
+	exposure_w = 0xffff;
+    regs_write(regs, 0x09, exposure_w);
+}
+
+int
+device_set_gain(struct regs *regs, double gain)
+{
+    device_queue_gain(regs, gain);
+    return regs_flush(regs);
+}
+
+int
+device_set_exposure(struct regs *regs, double exposure)
+{
+    device_queue_exposure(regs, exposure);
+    return regs_flush(regs);
+}
+
+int
+device_set_settings(struct regs *regs, double exposure, double gain)
+{
+    device_queue_exposure(regs, exposure);
+    device_queue_gain(regs, gain);
+    return regs_flush(regs);
+}
+
+static int
+device_set_resolution(struct regs *regs, int width, int height)
+{
+    static const uint16_t window[] = { 0x0014, 0x0020, 0x05ff, 0x07ff };
+    regs_write_burst(regs, 0x01, window, 4);
+    static const uint16_t mode_512x384[] = { 0x0003, 0x0003 };
+    static const uint16_t mode_1024x768[] = { 0x0011, 0x0011 };
+    static const uint16_t mode_2048x1536[] = { 0x0000, 0x0000 };
+    switch (width)
+    {
+    case 512:
+	assert(height == 384);
+	regs_write_burst(regs, 0x22, mode_512x384, 2);
+	break;
+    case 1024:
+	assert(height == 768);
+	regs_write_burst(regs, 0x22, mode_1024x768, 2);
+	break;
+    case 2048:
+	assert(height == 1536);
+	regs_write_burst(regs, 0x22, mode_2048x1536, 2);
+	break;
+    default:
+	assert(0);
+    }
+    return regs_flush(regs);
+}
+
+void
+delay_us(int us)
+{
+    struct timespec delay, remaining;
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = us % 1000000 * 1000;
+    while (nanosleep(&delay, &remaining) == -1) {
+	if (errno == EINTR)
+	    delay = remaining;
+	else
+	    error(EXIT_FAILURE, errno, "can not sleep");
+    }
+}
+
+int
+device_init(struct regs *regs, int width, int height, double exposure,
+	double gain)
+{
+    int r = device_reset(regs);
+    if (!r)
+	r = device_set_gain(regs, gain);
+    if (!r)
+	r = device_set_resolution(regs, width, height);
+    if (!r)
+	r = device_set_exposure(regs, exposure);
+    return r;
+}
+
+int
+device_uninit(struct regs *regs)
+{
+    return device_set_exposure(regs, 0.0);
+}
+
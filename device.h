@@ -0,0 +1,101 @@
+#ifndef device_h
+#define device_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "regs.h"
+
+/* Maximum depth of USB hubs chain. */
+#define DEVICE_PORTS_MAX 7
+
+/* Device location, as bus number and port path, written like 1-2.3. */
+struct device_location {
+    uint8_t bus;
+    uint8_t ports[DEVICE_PORTS_MAX];
+    int ports_nb;
+};
+
+/* Parse a device location, return false on syntax error. */
+bool
+device_location_parse(const char *str, struct device_location *location);
+
+/* Return true if both locations are the same. */
+bool
+device_location_equal(const struct device_location *a,
+	const struct device_location *b);
+
+/* Format a device location. */
+void
+device_location_format(const struct device_location *location, char *buf,
+	int size);
+
+/* List locations of connected cameras, return the number found. */
+int
+device_list(libusb_context *usb, struct device_location *locations,
+	int locations_size);
+
+/* Open the camera at the given location, return NULL if not found or if
+ * it can not be opened. */
+libusb_device_handle *
+device_open(libusb_context *usb, const struct device_location *location);
+
+/* Register a hotplug callback for cameras, return false if hotplug is
+ * not supported. */
+bool
+device_hotplug_register(libusb_context *usb, libusb_hotplug_callback_fn cb,
+	void *user_data, libusb_hotplug_callback_handle *handle);
+
+/* Device control functions return 0, or a libusb error, for example
+ * LIBUSB_ERROR_NO_DEVICE when the device is lost. */
+
+/* Set gain, nothing is sent if unchanged. */
+int
+device_set_gain(struct regs *regs, double gain);
+
+/* Set exposure in milliseconds, nothing is sent if unchanged. */
+int
+device_set_exposure(struct regs *regs, double exposure);
+
+/* Set exposure and gain, sent together. */
+int
+device_set_settings(struct regs *regs, double exposure, double gain);
+
+/* Initialise device, ready to send images.  This does not wait for the
+ * sensor, images are valid once the capture is locked on the first image
+ * boundary. */
+int
+device_init(struct regs *regs, int width, int height, double exposure,
+	double gain);
+
+/* Stop device. */
+int
+device_uninit(struct regs *regs);
+
+/* Sleep for the given number of microseconds. */
+void
+delay_us(int us);
+
+#endif /* device_h */
@@ -0,0 +1,339 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "encoder.h"
+
+/* Frame waiting for an encoder. */
+struct encoder_job {
+    struct frame *frame;
+    char *name;
+};
+
+struct encoder {
+    int threads_nb;
+    pthread_t *threads;
+    enum demosaic_method method;
+    enum demosaic_orientation orientation;
+    enum demosaic_format format;
+    enum encoder_profile profile;
+    int width;
+    int height;
+    /* Protect the following fields. */
+    pthread_mutex_t mutex;
+    /* Signaled when a job is queued, or on quit. */
+    pthread_cond_t put_cond;
+    /* Signaled when a job is taken, or when the last one is done. */
+    pthread_cond_t take_cond;
+    /* Circular queue of jobs. */
+    struct encoder_job *queue;
+    int queue_size;
+    int head;
+    int count;
+    /* Number of jobs taken but not written yet. */
+    int busy;
+    /* Number of frames handed so far. */
+    int handed;
+    bool quit;
+    struct encoder_stats stats;
+};
+
+static double
+encoder_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/* Settings of each profile.  Sensor noise defeats long matches, so that
+ * run length encoding of Paeth filtered lines is almost as small as the
+ * best zlib level, at a fraction of the cost.  The libpng default, level
+ * 6 with adaptive filtering, is slower than both fast and balanced. */
+static const struct {
+    int level;
+    int strategy;
+    int filters;
+} encoder_profiles[ENCODER_PROFILES_NB] = {
+    [ENCODER_FAST] = { 1, Z_RLE, PNG_FILTER_UP },
+    [ENCODER_BALANCED] = { 1, Z_RLE, PNG_FILTER_PAETH },
+    [ENCODER_SMALL] = { 9, Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS },
+};
+
+/* Called by libpng on error, must not return. */
+static void
+encoder_png_error(png_structp png, png_const_charp msg)
+{
+    error(EXIT_FAILURE, 0, "can not write image `%s': %s",
+	    (const char *) png_get_error_ptr(png), msg);
+}
+
+/* Write PNG header, rows are to be written next. */
+static png_structp
+encoder_png_start(FILE *file, const char *name, int width, int height,
+	enum demosaic_format format, enum encoder_profile profile,
+	png_infop *info)
+{
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+	    (png_voidp) name, encoder_png_error, NULL);
+    *info = png ? png_create_info_struct(png) : NULL;
+    if (!*info)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    png_init_io(png, file);
+    png_set_compression_level(png, encoder_profiles[profile].level);
+    png_set_compression_strategy(png, encoder_profiles[profile].strategy);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE,
+	    encoder_profiles[profile].filters);
+    png_set_IHDR(png, *info, width, height, 8, format == DEMOSAIC_GRAY
+	    ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+	    PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(png, *info);
+    if (format != DEMOSAIC_GRAY)
+	png_set_bgr(png);
+    return png;
+}
+
+/* Finish PNG file after the last row. */
+static void
+encoder_png_end(png_structp png, png_infop info)
+{
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+}
+
+void
+encoder_write_png(FILE *file, const char *name, const uint8_t *rgb,
+	int pitch, int width, int height, enum demosaic_format format,
+	enum encoder_profile profile)
+{
+    png_infop info;
+    png_structp png = encoder_png_start(file, name, width, height, format,
+	    profile, &info);
+    for (int y = 0; y < height; y++)
+	png_write_row(png, rgb + y * pitch);
+    encoder_png_end(png, info);
+}
+
+void
+encoder_stream_png(FILE *file, const char *name, struct workers *workers,
+	enum demosaic_method method, const uint8_t *bayer, uint8_t *lines,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, enum encoder_profile profile)
+{
+    int pitch = width * demosaic_bytes_per_pixel(format);
+    png_infop info;
+    png_structp png = encoder_png_start(file, name, width, height, format,
+	    profile, &info);
+    /* Output lines are taken from the bottom of the input when upside
+     * down. */
+    for (int y = 0; y < height; y += ENCODER_LINES) {
+	int n = height - y < ENCODER_LINES ? height - y : ENCODER_LINES;
+	int y0 = orientation & DEMOSAIC_ROTATE_180 ? height - y - n : y;
+	demosaic_convert_lines(workers, method, bayer, lines, pitch, width,
+		height, orientation, format, y0, y0 + n);
+	for (int i = 0; i < n; i++)
+	    png_write_row(png, lines + i * pitch);
+    }
+    encoder_png_end(png, info);
+}
+
+/* Convert and write one image, using a buffer of ENCODER_LINES lines, or
+ * of a whole image for quarter turns, as output lines are then input
+ * columns. */
+static void
+encoder_write(struct encoder *encoder, struct workers *workers,
+	const uint8_t *bayer, uint8_t *rgb, const char *name)
+{
+    int out_width, out_height;
+    demosaic_output_size(encoder->orientation, encoder->width,
+	    encoder->height, &out_width, &out_height);
+    int pitch = out_width * demosaic_bytes_per_pixel(encoder->format);
+    FILE *file = fopen(name, "wb");
+    if (!file)
+	error(EXIT_FAILURE, errno, "can not open output file `%s'", name);
+    if (encoder->orientation & 1) {
+	demosaic_convert(workers, encoder->method, bayer, rgb, pitch,
+		encoder->width, encoder->height, encoder->orientation,
+		encoder->format);
+	encoder_write_png(file, name, rgb, pitch, out_width, out_height,
+		encoder->format, encoder->profile);
+    } else {
+	encoder_stream_png(file, name, workers, encoder->method, bayer, rgb,
+		encoder->width, encoder->height, encoder->orientation,
+		encoder->format, encoder->profile);
+    }
+    if (fclose(file))
+	error(EXIT_FAILURE, errno, "can not write image `%s'", name);
+}
+
+static void *
+encoder_thread(void *arg)
+{
+    struct encoder *encoder = arg;
+    /* Encoders run in parallel, each one converts in its own thread,
+     * small bands would not be worth waking up workers. */
+    struct workers *workers = workers_new(1);
+    int lines = encoder->orientation & 1 ? encoder->height : ENCODER_LINES;
+    uint8_t *rgb = malloc(lines * encoder->width
+	    * demosaic_bytes_per_pixel(encoder->format));
+    if (!rgb)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    pthread_mutex_lock(&encoder->mutex);
+    while (1) {
+	while (!encoder->quit && !encoder->count)
+	    pthread_cond_wait(&encoder->put_cond, &encoder->mutex);
+	if (!encoder->count)
+	    break;
+	struct encoder_job job = encoder->queue[encoder->head];
+	encoder->head = (encoder->head + 1) % encoder->queue_size;
+	encoder->count--;
+	encoder->busy++;
+	pthread_cond_broadcast(&encoder->take_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	encoder_write(encoder, workers, job.frame->data, rgb, job.name);
+	frame_unref(job.frame);
+	free(job.name);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double encode = encoder_diff(&end, &start);
+	pthread_mutex_lock(&encoder->mutex);
+	struct encoder_stats *stats = &encoder->stats;
+	stats->frames++;
+	stats->encode_sum += encode;
+	if (encode > stats->encode_max)
+	    stats->encode_max = encode;
+	stats->last = end;
+	if (--encoder->busy == 0 && !encoder->count)
+	    pthread_cond_broadcast(&encoder->take_cond);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+    free(rgb);
+    workers_free(workers);
+    return NULL;
+}
+
+struct encoder *
+encoder_new(int threads_nb, int queue_size, enum demosaic_method method,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	enum encoder_profile profile, int width, int height)
+{
+    struct encoder *encoder = malloc(sizeof(*encoder));
+    if (!encoder)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    encoder->threads_nb = threads_nb;
+    encoder->threads = calloc(threads_nb, sizeof(*encoder->threads));
+    encoder->queue = calloc(queue_size, sizeof(*encoder->queue));
+    if (!encoder->threads || !encoder->queue)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    encoder->method = method;
+    encoder->orientation = orientation;
+    encoder->format = format;
+    encoder->profile = profile;
+    encoder->width = width;
+    encoder->height = height;
+    pthread_mutex_init(&encoder->mutex, NULL);
+    pthread_cond_init(&encoder->put_cond, NULL);
+    pthread_cond_init(&encoder->take_cond, NULL);
+    encoder->queue_size = queue_size;
+    encoder->head = 0;
+    encoder->count = 0;
+    encoder->busy = 0;
+    encoder->handed = 0;
+    encoder->quit = false;
+    memset(&encoder->stats, 0, sizeof(encoder->stats));
+    for (int i = 0; i < threads_nb; i++) {
+	int r = pthread_create(&encoder->threads[i], NULL, encoder_thread,
+		encoder);
+	if (r)
+	    error(EXIT_FAILURE, r, "can not create encoder thread");
+    }
+    return encoder;
+}
+
+void
+encoder_put(struct encoder *encoder, struct frame *frame, char *name)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&encoder->mutex);
+    struct encoder_stats *stats = &encoder->stats;
+    if (encoder->count == encoder->queue_size) {
+	while (encoder->count == encoder->queue_size)
+	    pthread_cond_wait(&encoder->take_cond, &encoder->mutex);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->blocked++;
+	stats->blocked_sum += encoder_diff(&now, &start);
+    }
+    if (!encoder->handed++)
+	stats->first = start;
+    int tail = (encoder->head + encoder->count) % encoder->queue_size;
+    encoder->queue[tail].frame = frame;
+    encoder->queue[tail].name = name;
+    encoder->count++;
+    if (encoder->count > stats->queue_high)
+	stats->queue_high = encoder->count;
+    pthread_cond_signal(&encoder->put_cond);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+void
+encoder_wait(struct encoder *encoder)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->count || encoder->busy)
+	pthread_cond_wait(&encoder->take_cond, &encoder->mutex);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+void
+encoder_get_stats(struct encoder *encoder, struct encoder_stats *stats)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    *stats = encoder->stats;
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+void
+encoder_free(struct encoder *encoder)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->quit = true;
+    pthread_cond_broadcast(&encoder->put_cond);
+    pthread_mutex_unlock(&encoder->mutex);
+    for (int i = 0; i < encoder->threads_nb; i++)
+	pthread_join(encoder->threads[i], NULL);
+    pthread_cond_destroy(&encoder->take_cond);
+    pthread_cond_destroy(&encoder->put_cond);
+    pthread_mutex_destroy(&encoder->mutex);
+    free(encoder->queue);
+    free(encoder->threads);
+    free(encoder);
+}
@@ -0,0 +1,121 @@
+#ifndef encoder_h
+#define encoder_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "demosaic.h"
+#include "pool.h"
+#include "workers.h"
+
+/* Background image writer.
+ *
+ * Frames to save are handed to a pool of encoder threads through a bounded
+ * queue, so that the consumer of captured frames only waits for PNG
+ * compression when all encoders are late.  Each frame is converted and
+ * written to the file named by the caller, so that names keep the capture
+ * order whatever the order in which encoders finish.
+ *
+ * Unless rotated by a quarter turn, images are converted a few lines at a
+ * time while compressed, so that an encoder only needs a small buffer
+ * which stays in cache. */
+struct encoder;
+
+/* Number of lines converted at once when streaming, must be even. */
+#define ENCODER_LINES 4
+
+/* PNG compression settings. */
+enum encoder_profile {
+    /* Run length encoding and the cheapest useful filter, for
+     * throughput. */
+    ENCODER_FAST,
+    /* Run length encoding and the Paeth filter, good on noisy images. */
+    ENCODER_BALANCED,
+    /* Best zlib level and adaptive filtering, for disk space. */
+    ENCODER_SMALL,
+    ENCODER_PROFILES_NB
+};
+
+/* Encoder statistics. */
+struct encoder_stats {
+    /* Number of written images. */
+    int frames;
+    /* Maximum number of frames waiting for an encoder. */
+    int queue_high;
+    /* Number of times a frame was handed to a full queue, and total time
+     * spent waiting for room, in seconds. */
+    int blocked;
+    double blocked_sum;
+    /* Sum and maximum of the time to convert and write one image, in
+     * seconds. */
+    double encode_sum;
+    double encode_max;
+    /* Time when the first frame was handed and when the last image was
+     * written. */
+    struct timespec first;
+    struct timespec last;
+};
+
+/* Write a BGR24 or gray image to a PNG file, name is used in messages. */
+void
+encoder_write_png(FILE *file, const char *name, const uint8_t *rgb,
+	int pitch, int width, int height, enum demosaic_format format,
+	enum encoder_profile profile);
+
+/* Convert a width x height Bayer image and write it to a PNG file while
+ * converting, ENCODER_LINES at a time in the lines buffer.  Orientation
+ * must not be a quarter turn, format must be BGR24 or gray. */
+void
+encoder_stream_png(FILE *file, const char *name, struct workers *workers,
+	enum demosaic_method method, const uint8_t *bayer, uint8_t *lines,
+	int width, int height, enum demosaic_orientation orientation,
+	enum demosaic_format format, enum encoder_profile profile);
+
+/* Start threads_nb threads to save width x height frames, with up to
+ * queue_size frames waiting.  Frames are converted by each encoder
+ * thread using the given method, orientation and format, which must be
+ * BGR24 or gray, then compressed with the given profile. */
+struct encoder *
+encoder_new(int threads_nb, int queue_size, enum demosaic_method method,
+	enum demosaic_orientation orientation, enum demosaic_format format,
+	enum encoder_profile profile, int width, int height);
+
+/* Hand a frame to save to the named file, wait if the queue is full.  Take
+ * ownership of the frame reference and of the malloc'ed name. */
+void
+encoder_put(struct encoder *encoder, struct frame *frame, char *name);
+
+/* Wait until all frames handed so far are written. */
+void
+encoder_wait(struct encoder *encoder);
+
+/* Get statistics, only exact after encoder_wait. */
+void
+encoder_get_stats(struct encoder *encoder, struct encoder_stats *stats);
+
+/* Stop threads and release resources, after writing waiting frames. */
+void
+encoder_free(struct encoder *encoder);
+
+#endif /* encoder_h */
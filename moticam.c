@@ -31,13 +31,24 @@
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <printf.h>
-#include <png.h>
 
 #include <SDL.h>
 
-#define ID_VENDOR 0x232f
-#define ID_PRODUCT 0x0100
+#include "ae.h"
+#include "capture.h"
+#include "demosaic.h"
+#include "device.h"
+#include "encoder.h"
+#include "pool.h"
+#include "rawfile.h"
+#include "replay.h"
+#include "workers.h"
+
+#define CAMERAS_MAX 8
 
 struct options {
     int width;
@@ -45,8 +56,54 @@ struct options {
     double exposure;
     double gain;
     int count;
+    int transfers;
+    int queue;
     bool raw;
-    const char *out;
+    const char *devices[CAMERAS_MAX];
+    int devices_nb;
+    const char *outs[CAMERAS_MAX];
+    int outs_nb;
+    const char *replay;
+    double rate;
+    int benchmark_startup;
+    int threads;
+    int encoders;
+    enum encoder_profile png_profile;
+    enum demosaic_method demosaic;
+    enum demosaic_orientation orientation;
+    bool gray;
+    bool auto_exposure;
+    double ae_target;
+    double ae_percentile;
+};
+
+/* Opened camera and its capture pipeline. */
+struct camera {
+    struct device_location location;
+    char name[32];
+    /* Prefix for messages, empty with a single camera. */
+    char prefix[36];
+    /* Each camera has its own context, so that its events are handled by
+     * its own capture thread. */
+    libusb_context *usb;
+    libusb_device_handle *handle;
+    /* Registers of the opened device. */
+    struct regs regs;
+    /* Settings last sent to the device, to initialise it again with them
+     * when it is lost. */
+    double exposure;
+    double gain;
+    struct pool *pool;
+    struct capture *capture;
+    struct ae ae;
+    /* Time when opening started, and time to open and initialise. */
+    struct timespec open_time;
+    double init_time;
+    /* Replay file used instead of the device, or NULL. */
+    struct replay *replay;
+    char *out;
+    struct options *options;
+    pthread_t thread;
 };
 
 void
@@ -55,13 +112,20 @@ usage(int status, const char *msg)
     if (msg)
 	error(0, 0, "%s", msg);
     fprintf(status == EXIT_SUCCESS ? stdout : stderr,
-	    "usage: %s [options] [FILE]\n"
+	    "usage: %s [options] [FILE...]\n"
 	    "\n"
 	    "Moticam 3+ viewer.\n"
 	    "\n"
+	    "In live video, use up and down keys to change exposure, right"
+	    " and left keys\n"
+	    "to change gain, a key to toggle auto exposure.\n"
+	    "\n"
 	    "positional arguments:\n"
-	    "  FILE               output file pattern (default: out%%02d.png"
-	    " or out for raw output)\n"
+	    "  FILE               output file pattern, one per camera"
+	    " (default: out%%02d.png\n"
+	    "                     or out for raw output, prefixed with"
+	    " camN- for several\n"
+	    "                     cameras)\n"
 	    "\n"
 	    "optional arguments:\n"
 	    "  -h, --help         show this help message and exit\n"
@@ -73,7 +137,54 @@ usage(int status, const char *msg)
 	    " default: 1)\n"
 	    "  -n, --count N      number of image to take"
 	    " (default: live video)\n"
-	    "  -r, --raw          save raw images\n"
+	    "  -r, --raw          save raw images, with their settings and"
+	    " an index\n"
+	    "  -G, --gray         save gray images\n"
+	    "  -z, --png-profile PROFILE\n"
+	    "                     PNG compression, fast, balanced or small"
+	    " (default:\n"
+	    "                     balanced)\n"
+	    "  -a, --auto-exposure\n"
+	    "                     adjust exposure and gain to reach the"
+	    " target level\n"
+	    "  -T, --ae-target LEVEL\n"
+	    "                     auto exposure target level (1 to 254,"
+	    " default: 100)\n"
+	    "  -P, --ae-percentile P\n"
+	    "                     use this percentile as the image level"
+	    " instead of the\n"
+	    "                     mean\n"
+	    "  -t, --transfers N  number of queued USB transfers (1 to 32,"
+	    " default: 4)\n"
+	    "  -q, --queue N      number of frames waiting to be processed"
+	    " (1 to 64, default: 4)\n"
+	    "  -D, --demosaic METHOD\n"
+	    "                     color interpolation, bilinear or mhc for"
+	    " better edges\n"
+	    "                     (default: bilinear)\n"
+	    "  -o, --rotate ANGLE image rotation, clockwise (0, 90, 180 or"
+	    " 270, default:\n"
+	    "                     180)\n"
+	    "  -m, --mirror       swap left and right, before rotation\n"
+	    "  -j, --threads N    number of threads used to convert images"
+	    " (1 to 64,\n"
+	    "                     default: number of processors)\n"
+	    "  -E, --encoders N   number of threads used to write images"
+	    " (1 to 64,\n"
+	    "                     default: number of processors)\n"
+	    "  -d, --device SEL   camera to use, by index (0, 1...), by"
+	    " location (1-2.3)\n"
+	    "                     or all, can be repeated"
+	    " (default: first camera)\n"
+	    "  -R, --replay FILE  read images from a raw file instead of"
+	    " a camera, width\n"
+	    "                     is only needed for bare images\n"
+	    "  -f, --rate FPS     replay frame rate (default: as fast as"
+	    " possible)\n"
+	    "  -B, --benchmark-startup N\n"
+	    "                     open the first camera and wait for its"
+	    " first frame N\n"
+	    "                     times, then print time statistics\n"
 	    , program_invocation_name);
     exit(status);
 }
@@ -86,8 +197,29 @@ parse_options(int argc, char **argv, struct options *options)
     options->exposure = 100.0;
     options->gain = 1.0;
     options->count = 0;
+    options->transfers = 4;
+    options->queue = 4;
     options->raw = false;
-    options->out = NULL;
+    options->gray = false;
+    options->png_profile = ENCODER_BALANCED;
+    options->demosaic = DEMOSAIC_BILINEAR;
+    /* The camera is mounted upside down on the microscope. */
+    options->orientation = DEMOSAIC_ROTATE_180;
+    bool mirror = false;
+    options->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options->threads < 1)
+	options->threads = 1;
+    else if (options->threads > 64)
+	options->threads = 64;
+    options->encoders = options->threads;
+    options->devices_nb = 0;
+    options->outs_nb = 0;
+    options->replay = NULL;
+    options->rate = 0.0;
+    options->benchmark_startup = 0;
+    options->auto_exposure = false;
+    options->ae_target = 100.0;
+    options->ae_percentile = 0.0;
     char *tail;
     while (1) {
 	static struct option long_options[] = {
@@ -97,11 +229,27 @@ parse_options(int argc, char **argv, struct options *options)
 	    { "gain", required_argument, 0, 'g' },
 	    { "count", required_argument, 0, 'n' },
 	    { "raw", required_argument, 0, 'r' },
+	    { "gray", no_argument, 0, 'G' },
+	    { "png-profile", required_argument, 0, 'z' },
+	    { "transfers", required_argument, 0, 't' },
+	    { "queue", required_argument, 0, 'q' },
+	    { "demosaic", required_argument, 0, 'D' },
+	    { "rotate", required_argument, 0, 'o' },
+	    { "mirror", no_argument, 0, 'm' },
+	    { "threads", required_argument, 0, 'j' },
+	    { "encoders", required_argument, 0, 'E' },
+	    { "device", required_argument, 0, 'd' },
+	    { "replay", required_argument, 0, 'R' },
+	    { "rate", required_argument, 0, 'f' },
+	    { "benchmark-startup", required_argument, 0, 'B' },
+	    { "auto-exposure", no_argument, 0, 'a' },
+	    { "ae-target", required_argument, 0, 'T' },
+	    { "ae-percentile", required_argument, 0, 'P' },
 	    { NULL },
 	};
 	int option_index = 0;
-	int c = getopt_long(argc, argv, "hw:e:g:n:r", long_options,
-		&option_index);
+	int c = getopt_long(argc, argv, "hw:e:g:n:rGz:t:q:D:o:mj:E:d:R:f:B:aT:P:",
+		long_options, &option_index);
 	if (c == -1)
 	    break;
 	switch (c) {
@@ -144,6 +292,108 @@ parse_options(int argc, char **argv, struct options *options)
 	case 'r':
 	    options->raw = true;
 	    break;
+	case 'G':
+	    options->gray = true;
+	    break;
+	case 't':
+	    errno = 0;
+	    options->transfers = strtoul(optarg, &tail, 10);
+	    if (*tail != '\0' || errno || options->transfers < 1
+		    || options->transfers > 32)
+		usage(EXIT_FAILURE, "bad transfers value");
+	    break;
+	case 'q':
+	    errno = 0;
+	    options->queue = strtoul(optarg, &tail, 10);
+	    if (*tail != '\0' || errno || options->queue < 1
+		    || options->queue > 64)
+		usage(EXIT_FAILURE, "bad queue value");
+	    break;
+	case 'z':
+	    if (strcmp(optarg, "fast") == 0)
+		options->png_profile = ENCODER_FAST;
+	    else if (strcmp(optarg, "balanced") == 0)
+		options->png_profile = ENCODER_BALANCED;
+	    else if (strcmp(optarg, "small") == 0)
+		options->png_profile = ENCODER_SMALL;
+	    else
+		usage(EXIT_FAILURE, "bad png profile value");
+	    break;
+	case 'D':
+	    if (strcmp(optarg, "bilinear") == 0)
+		options->demosaic = DEMOSAIC_BILINEAR;
+	    else if (strcmp(optarg, "mhc") == 0)
+		options->demosaic = DEMOSAIC_MHC;
+	    else
+		usage(EXIT_FAILURE, "bad demosaic value");
+	    break;
+	case 'o':
+	    if (strcmp(optarg, "0") == 0)
+		options->orientation = DEMOSAIC_ROTATE_0;
+	    else if (strcmp(optarg, "90") == 0)
+		options->orientation = DEMOSAIC_ROTATE_90;
+	    else if (strcmp(optarg, "180") == 0)
+		options->orientation = DEMOSAIC_ROTATE_180;
+	    else if (strcmp(optarg, "270") == 0)
+		options->orientation = DEMOSAIC_ROTATE_270;
+	    else
+		usage(EXIT_FAILURE, "bad rotate value");
+	    break;
+	case 'm':
+	    mirror = true;
+	    break;
+	case 'j':
+	    errno = 0;
+	    options->threads = strtoul(optarg, &tail, 10);
+	    if (*tail != '\0' || errno || options->threads < 1
+		    || options->threads > 64)
+		usage(EXIT_FAILURE, "bad threads value");
+	    break;
+	case 'E':
+	    errno = 0;
+	    options->encoders = strtoul(optarg, &tail, 10);
+	    if (*tail != '\0' || errno || options->encoders < 1
+		    || options->encoders > 64)
+		usage(EXIT_FAILURE, "bad encoders value");
+	    break;
+	case 'd':
+	    if (options->devices_nb == CAMERAS_MAX)
+		usage(EXIT_FAILURE, "too many devices");
+	    options->devices[options->devices_nb++] = optarg;
+	    break;
+	case 'R':
+	    options->replay = optarg;
+	    break;
+	case 'f':
+	    errno = 0;
+	    options->rate = strtod(optarg, &tail);
+	    if (*tail != '\0' || errno || options->rate <= 0.0
+		    || options->rate > 1000.0)
+		usage(EXIT_FAILURE, "bad rate value");
+	    break;
+	case 'a':
+	    options->auto_exposure = true;
+	    break;
+	case 'T':
+	    errno = 0;
+	    options->ae_target = strtod(optarg, &tail);
+	    if (*tail != '\0' || errno || options->ae_target < 1.0
+		    || options->ae_target > 254.0)
+		usage(EXIT_FAILURE, "bad ae-target value");
+	    break;
+	case 'P':
+	    errno = 0;
+	    options->ae_percentile = strtod(optarg, &tail);
+	    if (*tail != '\0' || errno || options->ae_percentile <= 0.0
+		    || options->ae_percentile >= 100.0)
+		usage(EXIT_FAILURE, "bad ae-percentile value");
+	    break;
+	case 'B':
+	    errno = 0;
+	    options->benchmark_startup = strtoul(optarg, &tail, 10);
+	    if (*tail != '\0' || errno || options->benchmark_startup < 1)
+		usage(EXIT_FAILURE, "bad benchmark-startup value");
+	    break;
 	case '?':
 	    usage(EXIT_FAILURE, NULL);
 	    break;
@@ -151,430 +401,697 @@ parse_options(int argc, char **argv, struct options *options)
 	    abort();
 	}
     }
-    if (optind < argc)
-	options->out = argv[optind++];
+    if (mirror)
+	options->orientation |= DEMOSAIC_MIRROR;
+    while (optind < argc && options->outs_nb < CAMERAS_MAX)
+	options->outs[options->outs_nb++] = argv[optind++];
     if (optind < argc)
 	usage(EXIT_FAILURE, "too many arguments");
-    if (!options->out)
-	options->out = options->raw ? "out" : "out%02d.png";
+    if (options->replay && options->devices_nb)
+	usage(EXIT_FAILURE, "can not use a device when replaying");
+    if (options->replay && options->benchmark_startup)
+	usage(EXIT_FAILURE, "can not benchmark startup when replaying");
     if (!options->raw)
     {
-	int argtypes[1];
-	int formats = parse_printf_format(options->out, 1, argtypes);
-	if (formats != 1 || argtypes[0] != PA_INT)
-	    usage(EXIT_FAILURE, "bad file pattern, use one %d");
-    }
-}
-
-libusb_device_handle *
-device_open()
-{
-    libusb_device **list;
-    libusb_device *found = NULL;
-    int nfound = 0;
-    ssize_t cnt = libusb_get_device_list(NULL, &list);
-    ssize_t i = 0;
-    if (cnt < 0)
-	error(EXIT_FAILURE, 0, "can not list devices: %s",
-		libusb_strerror(cnt));
-    for (i = 0; i < cnt; i++) {
-	libusb_device *device = list[i];
-	struct libusb_device_descriptor desc;
-	int r = libusb_get_device_descriptor(device, &desc);
-	if (r)
-	    error(EXIT_FAILURE, 0, "can not get device descriptor: %s",
-		    libusb_strerror(r));
-	if (desc.idVendor == ID_VENDOR && desc.idProduct == ID_PRODUCT) {
-	    found = device;
-	    nfound++;
-	    break;
+	for (int i = 0; i < options->outs_nb; i++) {
+	    int argtypes[1];
+	    int formats = parse_printf_format(options->outs[i], 1, argtypes);
+	    if (formats != 1 || argtypes[0] != PA_INT)
+		usage(EXIT_FAILURE, "bad file pattern, use one %d");
 	}
     }
-    if (nfound > 1)
-	error(EXIT_FAILURE, 0,
-		"more than one matching device, not supported");
-    libusb_device_handle *handle = NULL;
-    if (found) {
-	int r = libusb_open(found, &handle);
-	if (r)
-	    error(EXIT_FAILURE, 0, "can not open device: %s",
-		    libusb_strerror(r));
-    }
-    libusb_free_device_list(list, 1);
-    return handle;
-}
-
-void
-device_control_vendor(libusb_device_handle *handle, uint16_t wValue,
-	const uint8_t *data, int data_cnt)
-{
-    int r = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR, 240,
-	    wValue, 0, (uint8_t *) data, data_cnt, 0);
-    if (r < 0)
-	error(EXIT_FAILURE, 0, "can not send vendor: %s", libusb_strerror(r));
 }
 
-void
-device_control_vendor_w(libusb_device_handle *handle, uint16_t wValue,
-	const uint16_t data0)
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
 {
-    uint8_t data[] = { (uint8_t) (data0 >> 8), (uint8_t) data0 };
-    device_control_vendor(handle, wValue, data, sizeof(data));
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
 }
 
+/* Report time from camera opening to its first frame. */
 void
-device_reset(libusb_device_handle *handle)
+report_first_frame(struct camera *camera, struct frame *frame)
 {
-    device_control_vendor_w(handle, 0xba00, 0x0000);
-    device_control_vendor_w(handle, 0xba00, 0x0001);
+    struct options *options = camera->options;
+    fprintf(stderr, "%sfirst %dx%d frame after %.1f ms (open and init"
+	    " %.1f ms)\n", camera->prefix, options->width, options->height,
+	    timespec_diff(&frame->timestamp, &camera->open_time) * 1e3,
+	    camera->init_time * 1e3);
 }
 
 void
-device_set_gain(libusb_device_handle *handle, double gain)
+report_stats(struct camera *camera)
 {
-    double gmin, gmax;
-    int xmin, xmax;
-    bool up = false;
-    if (gain <= 1.34) {
-	gmin = 0.33;
-	gmax = 1.33;
-	xmin = 0x08;
-	xmax = 0x20;
-    } else if (gain <= 2.68) {
-	gmin = 1.42;
-	gmax = 2.67;
-	xmin = 0x51;
-	xmax = 0x60;
-    } else {
-	gmin = 3;
-	gmax = 42.67;
-	xmin = 0x1;
-	xmax = 0x78;
-	up = true;
+    const char *prefix = camera->prefix;
+    struct capture_stats stats;
+    capture_get_stats(camera->capture, &stats);
+    fprintf(stderr, "%s%d good frames (%d stitched), %d short, %d long,"
+	    " %d dropped on overflow\n", prefix, stats.good, stats.stitched,
+	    stats.short_, stats.long_, stats.dropped);
+    if (stats.good > 1) {
+	int intervals = stats.good - 1;
+	double mean = stats.interval_sum / intervals;
+	double var = stats.interval_sum2 / intervals - mean * mean;
+	fprintf(stderr, "%s%.2f fps, interval %.2f ms, jitter %.2f ms\n",
+		prefix, 1.0 / mean, mean * 1e3,
+		var > 0.0 ? sqrt(var) * 1e3 : 0.0);
+    }
+    if (stats.settles)
+	fprintf(stderr, "%s%d settings changes, settling mean %.1f frames"
+		" (%.0f ms), max %d frames\n", prefix, stats.settles,
+		(double) stats.settle_frames_sum / stats.settles,
+		stats.settle_time_sum / stats.settles * 1e3,
+		stats.settle_frames_max);
+    if (camera->ae.stats.frames) {
+	struct ae_stats *ae = &camera->ae.stats;
+	fprintf(stderr, "%sauto exposure cpu %.0f us/frame, max %.0f us\n",
+		prefix, ae->cpu_sum / ae->frames * 1e6, ae->cpu_max * 1e6);
+	if (ae->converges)
+	    fprintf(stderr, "%sauto exposure converged %d times, mean %.1f"
+		    " frames, max %d frames\n", prefix, ae->converges,
+		    (double) ae->converge_frames_sum / ae->converges,
+		    ae->converge_frames_max);
     }
-    int x = (gain - gmin) / (gmax - gmin) * (xmax - xmin) + xmin;
-    if (x < xmin)
-	x = xmin;
-    else if (x > xmax)
-	x = xmax;
-    if (up)
-	x = (x << 8) | 0x60;
-    device_control_vendor_w(handle, 0xba2d, x);
-    device_control_vendor_w(handle, 0xba2b, x);
-    device_control_vendor_w(handle, 0xba2e, x);
-    device_control_vendor_w(handle, 0xba2c, x);
+    if (stats.reconnects)
+	fprintf(stderr, "%s%d reconnections, recovery mean %.0f ms,"
+		" max %.0f ms\n", prefix, stats.reconnects,
+		stats.recovery_sum / stats.reconnects * 1e3,
+		stats.recovery_max * 1e3);
+    fprintf(stderr, "%squeue high-water mark %d/%d\n", prefix,
+	    stats.queue_high, camera->options->queue);
+    struct pool_stats pool_stats;
+    pool_get_stats(camera->pool, &pool_stats);
+    fprintf(stderr, "%spool high-water mark %d/%d, exhausted %d times\n",
+	    prefix, pool_stats.used_high, pool_stats.count,
+	    pool_stats.exhausted);
 }
 
+/* Report how encoders kept up with the capture. */
 void
-device_set_exposure(libusb_device_handle *handle, double exposure)
+report_encoder(struct camera *camera, struct encoder *encoder)
 {
-    int exposure_w = exposure * 12.82;
-    if (exposure_w < 0x000c)
-	exposure_w = 0x000c;
-    else if (exposure_w > 0xffff)
-	exposure_w = 0xffff;
-    device_control_vendor_w(handle, 0xba09, exposure_w);
+    const char *prefix = camera->prefix;
+    struct options *options = camera->options;
+    struct encoder_stats stats;
+    encoder_get_stats(encoder, &stats);
+    if (!stats.frames)
+	return;
+    double elapsed = timespec_diff(&stats.last, &stats.first);
+    fprintf(stderr, "%s%d images written in %.2f s, %.2f fps sustained,"
+	    " encode %.1f ms/image, max %.1f ms\n", prefix, stats.frames,
+	    elapsed, elapsed > 0.0 ? stats.frames / elapsed : 0.0,
+	    stats.encode_sum / stats.frames * 1e3, stats.encode_max * 1e3);
+    fprintf(stderr, "%sencoder backlog high-water mark %d/%d, full %d times"
+	    " for %.0f ms\n", prefix, stats.queue_high, options->queue,
+	    stats.blocked, stats.blocked_sum * 1e3);
 }
 
 void
-device_set_resolution(libusb_device_handle *handle, int width, int height)
+run(struct camera *camera)
 {
-    static const uint8_t control_init[] = {
-	0x00, 0x14, 0x00, 0x20, 0x05, 0xff, 0x07, 0xff };
-    device_control_vendor(handle, 0xba01, control_init,
-	    sizeof(control_init));
-    static const uint8_t control_512x384[] = { 0x00, 0x03, 0x00, 0x03 };
-    static const uint8_t control_1024x768[] = { 0x00, 0x11, 0x00, 0x11 };
-    static const uint8_t control_2048x1536[] = { 0x00, 0x00, 0x00, 0x00 };
-    switch (width)
-    {
-    case 512:
-	assert(height == 384);
-	device_control_vendor(handle, 0xba22, control_512x384,
-		sizeof(control_512x384));
-	break;
-    case 1024:
-	assert(height == 768);
-	device_control_vendor(handle, 0xba22, control_1024x768,
-		sizeof(control_1024x768));
-	break;
-    case 2048:
-	assert(height == 1536);
-	device_control_vendor(handle, 0xba22, control_2048x1536,
-		sizeof(control_2048x1536));
-	break;
-    default:
-	assert(0);
+    struct options *options = camera->options;
+    struct rawfile *out = NULL;
+    struct encoder *encoder = NULL;
+    if (options->raw) {
+	out = rawfile_create(camera->out, options->width, options->height);
+    } else {
+	/* No alpha in files. */
+	encoder = encoder_new(options->encoders, options->queue,
+		options->demosaic, options->orientation,
+		options->gray ? DEMOSAIC_GRAY : DEMOSAIC_BGR24,
+		options->png_profile, options->width, options->height);
     }
-}
-
-void
-delay_us(int us)
-{
-    struct timespec delay, remaining;
-    delay.tv_sec = us / 1000000;
-    delay.tv_nsec = us % 1000000 * 1000;
-    while (nanosleep(&delay, &remaining) == -1) {
-	if (errno == EINTR)
-	    delay = remaining;
-	else
-	    error(EXIT_FAILURE, errno, "can not sleep");
+    capture_start(camera->capture);
+    for (int i = 0; i < options->count; i++) {
+	struct frame *frame = capture_get(camera->capture);
+	if (i == 0)
+	    report_first_frame(camera, frame);
+	if (options->auto_exposure && ae_update(&camera->ae, frame,
+		    options->width, options->height))
+	    capture_set_settings(camera->capture, camera->ae.exposure,
+		    camera->ae.gain);
+	if (options->raw) {
+	    fprintf(stderr, "%swrite %d\n", camera->prefix, i);
+	    rawfile_write(out, frame);
+	    frame_unref(frame);
+	} else {
+	    /* Named here to keep capture order. */
+	    char *name = NULL;
+	    if (asprintf(&name, camera->out, i) < 0)
+		error(EXIT_FAILURE, 0, "can not prepare file name");
+	    fprintf(stderr, "%swrite %s\n", camera->prefix, name);
+	    encoder_put(encoder, frame, name);
+	}
+    }
+    capture_stop(camera->capture);
+    if (encoder)
+	encoder_wait(encoder);
+    report_stats(camera);
+    if (out)
+	rawfile_close(out);
+    if (encoder) {
+	report_encoder(camera, encoder);
+	encoder_free(encoder);
     }
 }
 
-void
-device_init(libusb_device_handle *handle, struct options *options)
+void *
+run_thread(void *arg)
 {
-    device_reset(handle);
-    device_set_gain(handle, options->gain);
-    device_set_exposure(handle, 30.0);
-    device_set_resolution(handle, options->width, options->height);
-    device_set_exposure(handle, options->exposure);
-    delay_us(100000);
+    run(arg);
+    return NULL;
 }
 
-void
-device_uninit(libusb_device_handle *handle)
-{
-    device_set_exposure(handle, 0.0);
-    device_set_exposure(handle, 0.0);
-    device_set_exposure(handle, 0.0);
-}
+/* Window showing one camera. */
+struct view {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    /* Half resolution texture, used when the window is smaller than the
+     * image. */
+    SDL_Texture *preview;
+    /* Format of textures. */
+    enum demosaic_format format;
+    bool first;
+    /* Displayed frames, time spent converting and in texture lock and
+     * unlock, in seconds. */
+    int frames;
+    double convert_sum;
+    double upload_sum, upload_max;
+};
 
+/* Report time spent to get images to the screen. */
 void
-bayer2argb(uint8_t *bayer, uint8_t *rgb, int width, int height)
+report_display(struct camera *camera, struct view *view)
 {
-    /*
-     * Compute missing value using an average of its neighbours.
-     * Input pattern:
-     * G R G R G R
-     * B G B G B G
-     * G R G R G R
-     * B G B G B G
-     */
-    const int in_stride = width;
-    const int out_stride = width * 4;
-    /* Skip first line and column. */
-    uint8_t *in = bayer + in_stride + 1;
-    uint8_t *out = rgb + out_stride + 4;
-    /* Loop over lines. */
-    for (int i = 1; i < height - 1; i += 2) {
-	/* Even lines. */
-	uint8_t *in_stop = in + (width - 2);
-	while (in != in_stop) {
-	    *out++ = (in[-1] + in[+1] + 1) >> 1;                 /* B */
-	    *out++ = in[0];                                      /* G */
-	    *out++ = (in[-in_stride] + in[+in_stride] + 1) >> 1; /* R */
-	    *out++ = 255;                                        /* A */
-	    in++;
-	    *out++ = in[0];                                      /* B */
-	    *out++ = (in[-in_stride] + in[+in_stride]            /* G */
-		    + in[-1] + in[+1] + 2) >> 2;
-	    *out++ = (in[-in_stride - 1] + in[-in_stride + 1]    /* R */
-		    + in[+in_stride - 1] + in[+in_stride + 1] + 2) >> 2;
-	    *out++ = 255;                                        /* A */
-	    in++;
-	}
-	/* Fill first and last pixels. */
-	out[-(width - 1) * 4 + 0] = out[-(width - 2) * 4 + 0];
-	out[-(width - 1) * 4 + 1] = out[-(width - 2) * 4 + 1];
-	out[-(width - 1) * 4 + 2] = out[-(width - 2) * 4 + 2];
-	out[-(width - 1) * 4 + 3] = out[-(width - 2) * 4 + 3];
-	out[0] = out[-4];
-	out[1] = out[-3];
-	out[2] = out[-2];
-	out[3] = out[-1];
-	out += out_stride - (width - 2) * 4;
-	in += in_stride - (width - 2);
-	/* Odd lines. */
-	in_stop = in + (width - 2);
-	while (in != in_stop) {
-	    *out++ = (in[-in_stride - 1] + in[-in_stride + 1]    /* B */
-		    + in[+in_stride - 1] + in[+in_stride + 1] + 2) >> 2;
-	    *out++ = (in[-in_stride] + in[+in_stride]            /* G */
-		    + in[-1] + in[+1] + 2) >> 2;
-	    *out++ = in[0];                                      /* R */
-	    *out++ = 255;                                        /* A */
-	    in++;
-	    *out++ = (in[-in_stride] + in[+in_stride] + 1) >> 1; /* B */
-	    *out++ = in[0];                                      /* G */
-	    *out++ = (in[-1] + in[+1] + 1) >> 1;                 /* R */
-	    *out++ = 255;                                        /* A */
-	    in++;
-	}
-	/* Fill first and last pixels. */
-	out[-(width - 1) * 4 + 0] = out[-(width - 2) * 4 + 0];
-	out[-(width - 1) * 4 + 1] = out[-(width - 2) * 4 + 1];
-	out[-(width - 1) * 4 + 2] = out[-(width - 2) * 4 + 2];
-	out[-(width - 1) * 4 + 3] = out[-(width - 2) * 4 + 3];
-	out[0] = out[-4];
-	out[1] = out[-3];
-	out[2] = out[-2];
-	out[3] = out[-1];
-	out += out_stride - (width - 2) * 4;
-	in += in_stride - (width - 2);
-    }
-    /* Last line. */
-    out -= 4;
-    memcpy (out, out - out_stride, width * 4);
-    /* First line. */
-    out -= (height - 1) * out_stride;
-    memcpy (out, out + out_stride, width * 4);
+    if (!view->frames)
+	return;
+    fprintf(stderr, "%sdisplay convert %.2f ms/frame, upload %.2f ms/frame,"
+	    " max %.2f ms\n", camera->prefix,
+	    view->convert_sum / view->frames * 1e3,
+	    view->upload_sum / view->frames * 1e3, view->upload_max * 1e3);
 }
 
-void
-run(libusb_device_handle *handle, struct options *options)
+/* Choose the smallest texture format supported by the renderer, others
+ * would be converted by SDL each time the texture is unlocked. */
+enum demosaic_format
+view_format(SDL_Renderer *renderer, Uint32 *sdl_format)
 {
-    int image_size = options->width * options->height;
-    int frame_size = 16384;
-    // Request an extra frame to read the zero length packet.
-    int data_size = (image_size + frame_size) / frame_size * frame_size;
-    uint8_t *data = malloc(data_size);
-    if (!data)
-	error(EXIT_FAILURE, 0, "memory exhausted");
-    FILE *out = NULL;
-    uint8_t *rgb = NULL;
-    if (options->raw) {
-	out = fopen(options->out, "wb");
-	if (!out)
-	    error(EXIT_FAILURE, errno, "can not open output file `%s'",
-		    options->out);
-    }
-    for (int i = 0; i < options->count;) {
-	int transfered = 0;
-	int r = libusb_bulk_transfer(handle, 0x83, data, data_size,
-		&transfered, 0);
-	if (r)
-	    error(EXIT_FAILURE, 0, "can not read data: %s",
-		    libusb_strerror(r));
-	if (transfered != image_size)
-	    fprintf(stderr, "bad image size (%d), drop\n", transfered);
-	else {
-	    if (options->raw) {
-		fprintf(stderr, "write %d (%d)\n", i, transfered);
-		r = fwrite(data, transfered, 1, out);
-		if (r < 0)
-		    error(EXIT_FAILURE, errno, "can not write");
-	    } else {
-		char *name = NULL;
-		if (asprintf(&name, options->out, i) < 0)
-		    error(EXIT_FAILURE, 0, "can not prepare file name");
-		fprintf(stderr, "write %s\n", name);
-		if (!rgb) {
-		    rgb = malloc(image_size * 4);
-		    if (!rgb)
-			error(EXIT_FAILURE, 0, "memory exhausted");
-		}
-		bayer2argb(data, rgb, options->width, options->height);
-		png_image image;
-		memset(&image, 0, sizeof(image));
-		image.version = PNG_IMAGE_VERSION;
-		image.width = options->width;
-		image.height = options->height;
-		image.format = PNG_FORMAT_BGRA;
-		r = png_image_write_to_file(&image, name, 0, rgb, 0, NULL);
-		if (r == 0)
-		    error(EXIT_FAILURE, 0, "can not write image: %s",
-			    image.message);
-	    }
-	    i++;
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info))
+	error(EXIT_FAILURE, 0, "can not get renderer info: %s",
+		SDL_GetError());
+    for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+	if (info.texture_formats[i] == SDL_PIXELFORMAT_BGR24) {
+	    *sdl_format = SDL_PIXELFORMAT_BGR24;
+	    return DEMOSAIC_BGR24;
 	}
     }
-    free(data);
-    if (out)
-	fclose(out);
-    if (rgb)
-	free(rgb);
+    *sdl_format = SDL_PIXELFORMAT_BGRA32;
+    return DEMOSAIC_BGRA32;
 }
 
 void
-run_video(libusb_device_handle *handle, struct options *options)
+run_video(struct camera *cameras, int cameras_nb, struct options *options)
 {
     if (SDL_Init(SDL_INIT_VIDEO))
 	error(EXIT_FAILURE, 0, "unable to initialize SDL: %s",
 		SDL_GetError());
     atexit(SDL_Quit);
     SDL_DisableScreenSaver();
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-    if (SDL_CreateWindowAndRenderer(options->width, options->height,
-	    SDL_WINDOW_RESIZABLE, &window, &renderer))
-	error(EXIT_FAILURE, 0, "unable to create window: %s", SDL_GetError());
-    SDL_SetWindowTitle(window, "Moticam");
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-    if (SDL_RenderSetLogicalSize(renderer, options->width, options->height))
-	error(EXIT_FAILURE, 0, "can not set logical size: %s", SDL_GetError());
-    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_BGRA32,
-	    SDL_TEXTUREACCESS_STREAMING, options->width, options->height);
-    if (!texture)
-	error(EXIT_FAILURE, 0, "can not create texture: %s", SDL_GetError());
-    int image_size = options->width * options->height;
-    int frame_size = 16384;
-    int data_size = (image_size + frame_size) / frame_size * frame_size;
-    uint8_t *data = malloc(data_size);
-    if (!data)
-	error(EXIT_FAILURE, 0, "memory exhausted");
-    uint8_t *rgb = malloc(image_size * 4);
-    if (!rgb)
-	error(EXIT_FAILURE, 0, "memory exhausted");
+    /* Images are converted with their final orientation. */
+    int width, height, preview_width, preview_height;
+    demosaic_output_size(options->orientation, options->width,
+	    options->height, &width, &height);
+    demosaic_output_size(options->orientation, options->width / 2,
+	    options->height / 2, &preview_width, &preview_height);
+    /* Threads used for image conversion, shared by all cameras. */
+    struct workers *workers = workers_new(options->threads);
+    struct view views[CAMERAS_MAX];
+    for (int i = 0; i < cameras_nb; i++) {
+	struct view *view = &views[i];
+	if (SDL_CreateWindowAndRenderer(width, height, SDL_WINDOW_RESIZABLE,
+		    &view->window, &view->renderer))
+	    error(EXIT_FAILURE, 0, "unable to create window: %s",
+		    SDL_GetError());
+	char title[64];
+	snprintf(title, sizeof(title), "Moticam %s", cameras[i].name);
+	SDL_SetWindowTitle(view->window, cameras_nb > 1 ? title : "Moticam");
+	if (SDL_RenderSetLogicalSize(view->renderer, width, height))
+	    error(EXIT_FAILURE, 0, "can not set logical size: %s",
+		    SDL_GetError());
+	Uint32 sdl_format;
+	view->format = view_format(view->renderer, &sdl_format);
+	view->texture = SDL_CreateTexture(view->renderer, sdl_format,
+		SDL_TEXTUREACCESS_STREAMING, width, height);
+	view->preview = SDL_CreateTexture(view->renderer, sdl_format,
+		SDL_TEXTUREACCESS_STREAMING, preview_width, preview_height);
+	if (!view->texture || !view->preview)
+	    error(EXIT_FAILURE, 0, "can not create texture: %s",
+		    SDL_GetError());
+	view->first = true;
+	view->frames = 0;
+	view->convert_sum = 0.0;
+	view->upload_sum = 0.0;
+	view->upload_max = 0.0;
+	capture_start(cameras[i].capture);
+    }
+    /* With a single camera, wait for its frames, else poll all of them. */
+    int timeout_ms = cameras_nb == 1 ? 100 : 0;
+    double exposure = options->exposure;
+    double gain = options->gain;
+    bool auto_exposure = options->auto_exposure;
     bool exit = false;
     while (1) {
 	SDL_Event event;
+	bool changed = false;
 	while (SDL_PollEvent(&event)) {
 	    if (event.type == SDL_QUIT)
 		exit = true;
-	    if (event.type == SDL_KEYDOWN
-		    && (event.key.keysym.sym == SDLK_q
-			|| event.key.keysym.sym == SDLK_ESCAPE))
+	    if (event.type == SDL_WINDOWEVENT
+		    && event.window.event == SDL_WINDOWEVENT_CLOSE)
 		exit = true;
+	    if (event.type == SDL_KEYDOWN) {
+		/* Manual changes start from the settings reached by auto
+		 * exposure, those of the first camera when there are
+		 * several. */
+		if (auto_exposure) {
+		    exposure = cameras[0].ae.exposure;
+		    gain = cameras[0].ae.gain;
+		}
+		switch (event.key.keysym.sym) {
+		case SDLK_q:
+		case SDLK_ESCAPE:
+		    exit = true;
+		    break;
+		case SDLK_UP:
+		    exposure = fmin(exposure * 1.25, 5000.0);
+		    changed = true;
+		    break;
+		case SDLK_DOWN:
+		    exposure = fmax(exposure / 1.25, 1.0);
+		    changed = true;
+		    break;
+		case SDLK_RIGHT:
+		    gain = fmin(gain * 1.25, 42.66);
+		    changed = true;
+		    break;
+		case SDLK_LEFT:
+		    gain = fmax(gain / 1.25, 0.33);
+		    changed = true;
+		    break;
+		case SDLK_a:
+		    auto_exposure = !auto_exposure;
+		    fprintf(stderr, "auto exposure %s\n",
+			    auto_exposure ? "on" : "off");
+		    for (int i = 0; i < cameras_nb && auto_exposure; i++) {
+			capture_set_settings(cameras[i].capture, exposure,
+				gain);
+			ae_init(&cameras[i].ae, options->ae_target,
+				options->ae_percentile, exposure, gain);
+		    }
+		    break;
+		}
+	    }
 	}
 	if (exit)
 	    break;
-	int transfered = 0;
-	int r = libusb_bulk_transfer(handle, 0x83, data, data_size,
-		&transfered, 0);
-	if (r)
-	    error(EXIT_FAILURE, 0, "can not read data: %s",
-		    libusb_strerror(r));
-	if (transfered != image_size)
-	    fprintf(stderr, "bad image size (%d), drop\n", transfered);
-	else {
-	    bayer2argb(data, rgb, options->width, options->height);
-	    SDL_UpdateTexture(texture, NULL, rgb, options->width * 4);
-	    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	    SDL_RenderClear(renderer);
-	    SDL_RenderCopyEx(renderer, texture, NULL, NULL, 180.0, NULL,
-		    SDL_FLIP_NONE);
-	    SDL_RenderPresent(renderer);
+	if (changed && auto_exposure) {
+	    fprintf(stderr, "auto exposure off\n");
+	    auto_exposure = false;
 	}
+	if (changed) {
+	    fprintf(stderr, "exposure %.1f ms, gain %.2f\n", exposure, gain);
+	    for (int i = 0; i < cameras_nb; i++)
+		capture_set_settings(cameras[i].capture, exposure, gain);
+	}
+	bool shown = false;
+	for (int i = 0; i < cameras_nb; i++) {
+	    struct view *view = &views[i];
+	    struct frame *frame = capture_get_timeout(cameras[i].capture,
+		    timeout_ms);
+	    if (!frame)
+		continue;
+	    if (view->first) {
+		report_first_frame(&cameras[i], frame);
+		view->first = false;
+	    }
+	    if (auto_exposure && ae_update(&cameras[i].ae, frame,
+			options->width, options->height))
+		capture_set_settings(cameras[i].capture, cameras[i].ae.exposure,
+			cameras[i].ae.gain);
+	    int out_width, out_height;
+	    if (SDL_GetRendererOutputSize(view->renderer, &out_width,
+			&out_height))
+		error(EXIT_FAILURE, 0, "can not get output size: %s",
+			SDL_GetError());
+	    /* When the image is scaled down anyway, convert each Bayer cell
+	     * to one pixel, which is much cheaper. */
+	    bool small = out_width < width || out_height < height;
+	    SDL_Texture *texture = small ? view->preview : view->texture;
+	    /* Convert directly to texture memory, its pitch may be larger
+	     * than a line. */
+	    struct timespec start, locked, converted, unlocked;
+	    void *pixels;
+	    int pitch;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    if (SDL_LockTexture(texture, NULL, &pixels, &pitch))
+		error(EXIT_FAILURE, 0, "can not lock texture: %s",
+			SDL_GetError());
+	    clock_gettime(CLOCK_MONOTONIC, &locked);
+	    if (small)
+		demosaic_superpixel(frame->data, pixels, pitch, options->width,
+			options->height, options->orientation, view->format);
+	    else
+		demosaic_convert(workers, options->demosaic, frame->data,
+			pixels, pitch, options->width, options->height,
+			options->orientation, view->format);
+	    clock_gettime(CLOCK_MONOTONIC, &converted);
+	    SDL_UnlockTexture(texture);
+	    clock_gettime(CLOCK_MONOTONIC, &unlocked);
+	    double upload = timespec_diff(&locked, &start)
+		+ timespec_diff(&unlocked, &converted);
+	    view->frames++;
+	    view->convert_sum += timespec_diff(&converted, &locked);
+	    view->upload_sum += upload;
+	    if (upload > view->upload_max)
+		view->upload_max = upload;
+	    frame_unref(frame);
+	    SDL_SetRenderDrawColor(view->renderer, 0, 0, 0, 0);
+	    SDL_RenderClear(view->renderer);
+	    SDL_RenderCopy(view->renderer, texture, NULL, NULL);
+	    SDL_RenderPresent(view->renderer);
+	    shown = true;
+	}
+	if (!shown && cameras_nb > 1)
+	    delay_us(2000);
     }
-    free(rgb);
-    free(data);
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    for (int i = 0; i < cameras_nb; i++) {
+	struct view *view = &views[i];
+	capture_stop(cameras[i].capture);
+	report_stats(&cameras[i]);
+	report_display(&cameras[i], view);
+	SDL_DestroyTexture(view->preview);
+	SDL_DestroyTexture(view->texture);
+	SDL_DestroyRenderer(view->renderer);
+	SDL_DestroyWindow(view->window);
+    }
+    workers_free(workers);
 }
 
+/* Find cameras matching selectors, return their number. */
 int
-main(int argc, char **argv)
+select_cameras(struct options *options, struct camera *cameras)
 {
-    struct options options;
-    parse_options(argc, argv, &options);
     libusb_context *usb;
     int r = libusb_init(&usb);
     if (r)
 	error(EXIT_FAILURE, 0, "unable to initialize libusb: %s",
 		libusb_strerror(r));
-    libusb_device_handle *handle = device_open();
-    if (!handle)
+    struct device_location found[CAMERAS_MAX];
+    int found_nb = device_list(usb, found, CAMERAS_MAX);
+    libusb_exit(usb);
+    if (!found_nb)
 	error(EXIT_FAILURE, 0, "unable to find device");
-    device_init(handle, &options);
-    if (options.count)
-	run(handle, &options);
+    int cameras_nb = 0;
+    if (!options->devices_nb)
+	cameras[cameras_nb++].location = found[0];
+    for (int i = 0; i < options->devices_nb; i++) {
+	const char *sel = options->devices[i];
+	char *tail;
+	if (strcmp(sel, "all") == 0) {
+	    for (int j = 0; j < found_nb && cameras_nb < CAMERAS_MAX; j++)
+		cameras[cameras_nb++].location = found[j];
+	    continue;
+	}
+	if (cameras_nb == CAMERAS_MAX)
+	    error(EXIT_FAILURE, 0, "too many devices");
+	errno = 0;
+	unsigned long index = strtoul(sel, &tail, 10);
+	if (*tail == '\0' && !errno) {
+	    if (index >= (unsigned long) found_nb)
+		error(EXIT_FAILURE, 0, "no camera with index %lu", index);
+	    cameras[cameras_nb++].location = found[index];
+	} else if (device_location_parse(sel, &cameras[cameras_nb].location))
+	    cameras_nb++;
+	else
+	    usage(EXIT_FAILURE, "bad device value");
+    }
+    /* The same device can not be opened twice. */
+    for (int i = 0; i < cameras_nb; i++) {
+	for (int j = 0; j < i; j++) {
+	    if (device_location_equal(&cameras[i].location,
+			&cameras[j].location)) {
+		char name[32];
+		device_location_format(&cameras[i].location, name,
+			sizeof(name));
+		error(EXIT_FAILURE, 0, "device %s selected twice", name);
+	    }
+	}
+    }
+    return cameras_nb;
+}
+
+/* Return the number of frames held by the consumer, including those
+ * waiting for an encoder or being written. */
+int
+consumer_frames(struct options *options)
+{
+    if (options->count && !options->raw)
+	return 1 + options->queue + options->encoders;
+    return 1;
+}
+
+/* Open replay file as a virtual camera. */
+void
+camera_open_replay(struct camera *camera, struct options *options)
+{
+    strcpy(camera->name, "replay");
+    camera->prefix[0] = '\0';
+    camera->options = options;
+    camera->out = strdup(options->outs_nb ? options->outs[0]
+	    : options->raw ? "out" : "out%02d.png");
+    if (!camera->out)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    clock_gettime(CLOCK_MONOTONIC, &camera->open_time);
+    camera->init_time = 0.0;
+    camera->usb = NULL;
+    camera->handle = NULL;
+    camera->replay = replay_open(options->replay, options->width,
+	    options->height);
+    /* Files other than bare images give their own size. */
+    options->width = replay_width(camera->replay);
+    options->height = replay_height(camera->replay);
+    /* Frames are held by the replay thread, by the queue and by the
+     * consumer. */
+    camera->pool = pool_new(options->width, options->height,
+	    1 + options->queue + consumer_frames(options));
+    camera->capture = capture_new_replay(camera->replay, options->rate,
+	    camera->pool, options->width, options->height, options->queue);
+    capture_set_settings(camera->capture, options->exposure, options->gain);
+    ae_init(&camera->ae, options->ae_target, options->ae_percentile,
+	    options->exposure, options->gain);
+}
+
+/* Open and initialise camera device, used again if it is lost. */
+libusb_device_handle *
+camera_reopen(void *data)
+{
+    struct camera *camera = data;
+    struct options *options = camera->options;
+    libusb_device_handle *handle = device_open(camera->usb,
+	    &camera->location);
+    if (handle) {
+	regs_init(&camera->regs, camera->usb, handle);
+	int r = device_init(&camera->regs, options->width, options->height,
+		camera->exposure, camera->gain);
+	if (r) {
+	    error(0, 0, "can not initialise device %s: %s", camera->name,
+		    libusb_strerror(r));
+	    libusb_close(handle);
+	    handle = NULL;
+	}
+    }
+    return handle;
+}
+
+/* Send new settings, called from the capture thread. */
+int
+camera_apply(void *data, double exposure, double gain)
+{
+    struct camera *camera = data;
+    int r = device_set_settings(&camera->regs, exposure, gain);
+    if (!r) {
+	camera->exposure = exposure;
+	camera->gain = gain;
+    }
+    return r;
+}
+
+/* Open camera and prepare its capture pipeline. */
+void
+camera_open(struct camera *camera, int index, int cameras_nb,
+	struct options *options)
+{
+    device_location_format(&camera->location, camera->name,
+	    sizeof(camera->name));
+    if (cameras_nb > 1)
+	snprintf(camera->prefix, sizeof(camera->prefix), "%s: ",
+		camera->name);
     else
-	run_video(handle, &options);
-    device_uninit(handle);
-    libusb_close(handle);
-    libusb_exit(usb);
+	camera->prefix[0] = '\0';
+    camera->options = options;
+    if (options->outs_nb)
+	camera->out = strdup(options->outs[index]);
+    else if (cameras_nb == 1)
+	camera->out = strdup(options->raw ? "out" : "out%02d.png");
+    else if (asprintf(&camera->out, options->raw ? "cam%d-out"
+		: "cam%d-out%%02d.png", index) < 0)
+	camera->out = NULL;
+    if (!camera->out)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    camera->replay = NULL;
+    camera->exposure = options->exposure;
+    camera->gain = options->gain;
+    clock_gettime(CLOCK_MONOTONIC, &camera->open_time);
+    int r = libusb_init(&camera->usb);
+    if (r)
+	error(EXIT_FAILURE, 0, "unable to initialize libusb: %s",
+		libusb_strerror(r));
+    camera->handle = camera_reopen(camera);
+    if (!camera->handle)
+	error(EXIT_FAILURE, 0, "unable to open device %s", camera->name);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    camera->init_time = timespec_diff(&now, &camera->open_time);
+    /* Frames are held by transfers, by the assembler, by the queue and by
+     * the consumer. */
+    camera->pool = pool_new(options->width, options->height,
+	    options->transfers + 1 + options->queue
+	    + consumer_frames(options));
+    camera->capture = capture_new(camera->usb, camera->handle, camera->pool,
+	    options->width, options->height, options->transfers,
+	    options->queue);
+    capture_set_settings(camera->capture, options->exposure, options->gain);
+    ae_init(&camera->ae, options->ae_target, options->ae_percentile,
+	    options->exposure, options->gain);
+    capture_set_reopen(camera->capture, camera_reopen, camera);
+    capture_set_apply(camera->capture, camera_apply, camera);
+    capture_set_prefix(camera->capture, camera->prefix);
+}
+
+void
+camera_close(struct camera *camera)
+{
+    camera->handle = capture_get_handle(camera->capture);
+    capture_free(camera->capture);
+    pool_free(camera->pool);
+    if (camera->handle) {
+	device_uninit(&camera->regs);
+	libusb_close(camera->handle);
+    }
+    if (camera->usb)
+	libusb_exit(camera->usb);
+    if (camera->replay)
+	replay_close(camera->replay);
+    free(camera->out);
+}
+
+static int
+double_compare(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+/* Print distribution of n measures, in milliseconds. */
+void
+report_distribution(const char *name, double *values, int n)
+{
+    qsort(values, n, sizeof(*values), double_compare);
+    double sum = 0.0, sum2 = 0.0;
+    for (int i = 0; i < n; i++) {
+	sum += values[i];
+	sum2 += values[i] * values[i];
+    }
+    double mean = sum / n;
+    double var = sum2 / n - mean * mean;
+    fprintf(stderr, "%s: min %.1f ms, median %.1f ms, p90 %.1f ms,"
+	    " max %.1f ms, mean %.1f ms, stddev %.1f ms\n", name,
+	    values[0] * 1e3, values[n / 2] * 1e3, values[n * 9 / 10] * 1e3,
+	    values[n - 1] * 1e3, mean * 1e3,
+	    var > 0.0 ? sqrt(var) * 1e3 : 0.0);
+}
+
+/* Open camera, wait for its first frame and close it again, several
+ * times. */
+void
+benchmark_startup(struct camera *camera, struct options *options)
+{
+    int n = options->benchmark_startup;
+    double *init = malloc(n * sizeof(*init));
+    double *first = malloc(n * sizeof(*first));
+    if (!init || !first)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    for (int i = 0; i < n; i++) {
+	camera_open(camera, 0, 1, options);
+	capture_start(camera->capture);
+	struct frame *frame = capture_get_timeout(camera->capture, 5000);
+	if (!frame)
+	    error(EXIT_FAILURE, 0, "no frame received");
+	init[i] = camera->init_time;
+	first[i] = timespec_diff(&frame->timestamp, &camera->open_time);
+	frame_unref(frame);
+	capture_stop(camera->capture);
+	camera_close(camera);
+    }
+    fprintf(stderr, "%d startups at %dx%d\n", n, options->width,
+	    options->height);
+    report_distribution("open and init", init, n);
+    report_distribution("first frame", first, n);
+    free(init);
+    free(first);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct options options;
+    parse_options(argc, argv, &options);
+    struct camera cameras[CAMERAS_MAX];
+    int cameras_nb;
+    if (options.replay) {
+	cameras_nb = 1;
+	if (options.outs_nb > 1)
+	    usage(EXIT_FAILURE, "too many arguments");
+	camera_open_replay(&cameras[0], &options);
+    } else {
+	cameras_nb = select_cameras(&options, cameras);
+	if (options.benchmark_startup) {
+	    benchmark_startup(&cameras[0], &options);
+	    return EXIT_SUCCESS;
+	}
+	if (options.outs_nb && options.outs_nb != cameras_nb)
+	    usage(EXIT_FAILURE, "one file pattern needed per camera");
+	for (int i = 0; i < cameras_nb; i++)
+	    camera_open(&cameras[i], i, cameras_nb, &options);
+    }
+    if (!options.count)
+	run_video(cameras, cameras_nb, &options);
+    else if (cameras_nb == 1)
+	run(&cameras[0]);
+    else {
+	for (int i = 0; i < cameras_nb; i++) {
+	    int r = pthread_create(&cameras[i].thread, NULL, run_thread,
+		    &cameras[i]);
+	    if (r)
+		error(EXIT_FAILURE, r, "can not create thread");
+	}
+	for (int i = 0; i < cameras_nb; i++)
+	    pthread_join(cameras[i].thread, NULL);
+    }
+    for (int i = 0; i < cameras_nb; i++)
+	camera_close(&cameras[i]);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,131 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdlib.h>
+#include <error.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define FRAME_SIZE 16384
+
+/* Frames are given back from any consumer thread, the free stack is
+ * protected by a mutex.  It is only held for a few instructions. */
+struct pool {
+    int count;
+    struct frame *frames;
+    struct frame **free;
+    int free_nb;
+    pthread_mutex_t mutex;
+    struct pool_stats stats;
+};
+
+struct pool *
+pool_new(int width, int height, int count)
+{
+    struct pool *pool = malloc(sizeof(*pool));
+    if (!pool)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    int image_size = width * height;
+    // Request an extra frame to read the zero length packet.
+    int size = (image_size + FRAME_SIZE) / FRAME_SIZE * FRAME_SIZE;
+    pool->count = count;
+    pool->frames = calloc(count, sizeof(*pool->frames));
+    pool->free = calloc(count, sizeof(*pool->free));
+    if (!pool->frames || !pool->free)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    for (int i = 0; i < count; i++) {
+	struct frame *frame = &pool->frames[i];
+	frame->data = malloc(size);
+	if (!frame->data)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+	frame->size = size;
+	frame->pool = pool;
+	atomic_init(&frame->refs, 0);
+	pool->free[i] = frame;
+    }
+    pool->free_nb = count;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->stats.count = count;
+    pool->stats.used = 0;
+    pool->stats.used_high = 0;
+    pool->stats.exhausted = 0;
+    return pool;
+}
+
+void
+pool_free(struct pool *pool)
+{
+    assert(pool->free_nb == pool->count);
+    for (int i = 0; i < pool->count; i++)
+	free(pool->frames[i].data);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->free);
+    free(pool->frames);
+    free(pool);
+}
+
+struct frame *
+pool_get(struct pool *pool)
+{
+    struct frame *frame = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_nb) {
+	frame = pool->free[--pool->free_nb];
+	pool->stats.used++;
+	if (pool->stats.used > pool->stats.used_high)
+	    pool->stats.used_high = pool->stats.used;
+    } else
+	pool->stats.exhausted++;
+    pthread_mutex_unlock(&pool->mutex);
+    if (frame)
+	atomic_store(&frame->refs, 1);
+    return frame;
+}
+
+void
+frame_ref(struct frame *frame)
+{
+    atomic_fetch_add(&frame->refs, 1);
+}
+
+void
+frame_unref(struct frame *frame)
+{
+    if (atomic_fetch_sub(&frame->refs, 1) == 1) {
+	struct pool *pool = frame->pool;
+	pthread_mutex_lock(&pool->mutex);
+	pool->free[pool->free_nb++] = frame;
+	pool->stats.used--;
+	pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+void
+pool_get_stats(struct pool *pool, struct pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
+}
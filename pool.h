@@ -0,0 +1,101 @@
+#ifndef pool_h
+#define pool_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+struct pool;
+
+/* Frame flags. */
+enum frame_flags {
+    /* Image was received in several transfers. */
+    FRAME_STITCHED = 1,
+    /* First image after data was discarded or the device was lost. */
+    FRAME_RESYNC = 2,
+    /* Settings were changed and the image may not reflect them yet. */
+    FRAME_SETTLING = 4,
+};
+
+/* Frame buffer, owned by whoever holds a reference to it. */
+struct frame {
+    /* Raw image data. */
+    uint8_t *data;
+    /* Size of the data buffer, larger than the image. */
+    int size;
+    /* Number of bytes received. */
+    int length;
+    /* Sequence number, incremented for each image boundary, so that gaps
+     * show dropped frames. */
+    uint32_t sequence;
+    /* Arrival time, from CLOCK_MONOTONIC. */
+    struct timespec timestamp;
+    /* Settings in effect when the frame was received. */
+    double exposure;
+    double gain;
+    /* See enum frame_flags. */
+    int flags;
+    struct pool *pool;
+    atomic_int refs;
+};
+
+/* Pool statistics. */
+struct pool_stats {
+    /* Number of frames in pool. */
+    int count;
+    /* Number of frames currently checked out. */
+    int used;
+    /* Maximum number of frames checked out at the same time. */
+    int used_high;
+    /* Number of times a frame was requested from an empty pool. */
+    int exhausted;
+};
+
+/* Allocate a pool of count frames, large enough for a width x height
+ * image plus the extra USB frame used to read the zero length packet. */
+struct pool *
+pool_new(int width, int height, int count);
+
+/* Release pool memory, all frames must have been given back. */
+void
+pool_free(struct pool *pool);
+
+/* Check out a frame with one reference, or return NULL if the pool is
+ * empty. */
+struct frame *
+pool_get(struct pool *pool);
+
+/* Add a reference to a frame, to hand it to one more consumer. */
+void
+frame_ref(struct frame *frame);
+
+/* Drop a reference, the frame goes back to its pool with the last one. */
+void
+frame_unref(struct frame *frame);
+
+/* Get pool statistics. */
+void
+pool_get_stats(struct pool *pool, struct pool_stats *stats);
+
+#endif /* pool_h */
@@ -0,0 +1,141 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+
+#include "rawfile.h"
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+	"raw files are written as is, in little endian");
+_Static_assert(sizeof(struct rawfile_header) == 48, "bad header size");
+_Static_assert(sizeof(struct rawfile_frame) == 32, "bad frame size");
+_Static_assert(sizeof(struct rawfile_trailer) == 24, "bad trailer size");
+
+struct rawfile {
+    FILE *file;
+    char *name;
+    int image_size;
+    /* Offset of the next frame. */
+    uint64_t offset;
+    /* Offsets of written frames, kept until close. */
+    uint64_t *index;
+    int count;
+    int index_size;
+};
+
+static int64_t
+rawfile_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+rawfile_put(struct rawfile *rawfile, const void *data, size_t size)
+{
+    if (size && fwrite(data, size, 1, rawfile->file) != 1)
+	error(EXIT_FAILURE, errno, "can not write `%s'", rawfile->name);
+    rawfile->offset += size;
+}
+
+struct rawfile *
+rawfile_create(const char *name, int width, int height)
+{
+    struct rawfile *rawfile = malloc(sizeof(*rawfile));
+    if (!rawfile)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    rawfile->file = fopen(name, "wb");
+    if (!rawfile->file)
+	error(EXIT_FAILURE, errno, "can not open output file `%s'", name);
+    rawfile->name = strdup(name);
+    if (!rawfile->name)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    rawfile->image_size = width * height;
+    rawfile->offset = 0;
+    rawfile->index = NULL;
+    rawfile->count = 0;
+    rawfile->index_size = 0;
+    struct rawfile_header header = {
+	.magic = RAWFILE_MAGIC,
+	.version = RAWFILE_VERSION,
+	.width = width,
+	.height = height,
+	.cfa = { 'G', 'R', 'B', 'G' },
+	.frame_header_size = sizeof(struct rawfile_frame),
+	.realtime = rawfile_ns(CLOCK_REALTIME),
+	.monotonic = rawfile_ns(CLOCK_MONOTONIC),
+    };
+    rawfile_put(rawfile, &header, sizeof(header));
+    return rawfile;
+}
+
+void
+rawfile_write(struct rawfile *rawfile, const struct frame *frame)
+{
+    if (rawfile->count == rawfile->index_size) {
+	rawfile->index_size = rawfile->index_size ? rawfile->index_size * 2
+	    : 256;
+	rawfile->index = realloc(rawfile->index,
+		rawfile->index_size * sizeof(*rawfile->index));
+	if (!rawfile->index)
+	    error(EXIT_FAILURE, 0, "memory exhausted");
+    }
+    rawfile->index[rawfile->count++] = rawfile->offset;
+    struct rawfile_frame header = {
+	.sequence = frame->sequence,
+	.flags = frame->flags,
+	.timestamp = frame->timestamp.tv_sec * 1000000000LL
+	    + frame->timestamp.tv_nsec,
+	.exposure = frame->exposure,
+	.gain = frame->gain,
+    };
+    static const uint8_t padding[8];
+    rawfile_put(rawfile, &header, sizeof(header));
+    rawfile_put(rawfile, frame->data, rawfile->image_size);
+    rawfile_put(rawfile, padding,
+	    RAWFILE_ALIGN(rawfile->image_size) - rawfile->image_size);
+}
+
+void
+rawfile_close(struct rawfile *rawfile)
+{
+    struct rawfile_trailer trailer = {
+	.index_offset = rawfile->offset,
+	.count = rawfile->count,
+	.magic = RAWFILE_INDEX_MAGIC,
+    };
+    rawfile_put(rawfile, rawfile->index,
+	    rawfile->count * sizeof(*rawfile->index));
+    rawfile_put(rawfile, &trailer, sizeof(trailer));
+    if (fclose(rawfile->file))
+	error(EXIT_FAILURE, errno, "can not write `%s'", rawfile->name);
+    free(rawfile->index);
+    free(rawfile->name);
+    free(rawfile);
+}
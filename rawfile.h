@@ -0,0 +1,100 @@
+#ifndef rawfile_h
+#define rawfile_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+/* Raw image container.
+ *
+ * A file starts with a header giving the image size and Bayer pattern,
+ * followed by the frames, each one made of a small header and of the
+ * image data, appended one after the other while recording.  On close,
+ * an index of frame offsets and a trailer pointing to it are appended, so
+ * that a reader mapping the file can find any frame directly.  Numbers
+ * are little endian, structures are written as is.  Frames are padded to
+ * keep headers and index aligned. */
+struct rawfile;
+
+#define RAWFILE_MAGIC "MOTIRAW"
+#define RAWFILE_INDEX_MAGIC "MOTIIDX"
+#define RAWFILE_VERSION 1
+
+/* Round a size up to the alignment of frames and index. */
+#define RAWFILE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+/* File header. */
+struct rawfile_header {
+    /* RAWFILE_MAGIC, with its terminating zero. */
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    /* Bayer pattern, starting at the top left pixel, "GRBG". */
+    char cfa[4];
+    /* Size of each frame header, to skip fields added later. */
+    uint32_t frame_header_size;
+    uint32_t reserved;
+    /* Wall clock and CLOCK_MONOTONIC time at creation, in nanoseconds, to
+     * convert frame timestamps. */
+    int64_t realtime;
+    int64_t monotonic;
+};
+
+/* Frame header, followed by width x height bytes of image and padding. */
+struct rawfile_frame {
+    /* Sequence number, gaps show dropped frames. */
+    uint32_t sequence;
+    /* See enum frame_flags. */
+    uint32_t flags;
+    /* Arrival time, from CLOCK_MONOTONIC, in nanoseconds. */
+    int64_t timestamp;
+    /* Exposure in milliseconds and gain. */
+    double exposure;
+    double gain;
+};
+
+/* End of file, after the index made of one 64 bit offset per frame. */
+struct rawfile_trailer {
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t reserved;
+    /* RAWFILE_INDEX_MAGIC, last, to tell whether the file is complete. */
+    char magic[8];
+};
+
+/* Create a file for width x height images. */
+struct rawfile *
+rawfile_create(const char *name, int width, int height);
+
+/* Append a frame, with its information. */
+void
+rawfile_write(struct rawfile *rawfile, const struct frame *frame);
+
+/* Write index and close file. */
+void
+rawfile_close(struct rawfile *rawfile);
+
+#endif /* rawfile_h */
@@ -0,0 +1,143 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <error.h>
+
+#include "regs.h"
+
+/* Vendor request used to access sensor registers. */
+#define REGS_REQUEST 240
+/* Register address in wValue, as the sensor I2C address and register. */
+#define REGS_ADDRESS(reg) (0xba00 | (reg))
+
+void
+regs_init(struct regs *regs, libusb_context *usb,
+	libusb_device_handle *handle)
+{
+    regs->usb = usb;
+    regs->handle = handle;
+    regs->known = 0;
+    regs->dirty = 0;
+    regs->pending = 0;
+    regs->done = 1;
+    regs->status = 0;
+}
+
+void
+regs_write(struct regs *regs, int reg, uint16_t value)
+{
+    uint64_t bit = (uint64_t) 1 << reg;
+    if ((regs->known & bit) && regs->values[reg] == value)
+	return;
+    regs->values[reg] = value;
+    regs->known |= bit;
+    regs->dirty |= bit;
+}
+
+void
+regs_write_burst(struct regs *regs, int reg, const uint16_t *values,
+	int count)
+{
+    for (int i = 0; i < count; i++)
+	regs_write(regs, reg + i, values[i]);
+}
+
+void
+regs_invalidate(struct regs *regs)
+{
+    regs->known = 0;
+    regs->dirty = 0;
+}
+
+static void LIBUSB_CALL
+regs_callback(struct libusb_transfer *transfer)
+{
+    struct regs *regs = transfer->user_data;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !regs->status)
+	regs->status = transfer->status == LIBUSB_TRANSFER_NO_DEVICE
+	    ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+    regs->pending--;
+    regs->done = !regs->pending;
+}
+
+/* Submit a transfer for count registers starting at reg. */
+static void
+regs_submit(struct regs *regs, int reg, int count)
+{
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    uint8_t *buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + count * 2);
+    if (!transfer || !buffer)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    libusb_fill_control_setup(buffer, LIBUSB_REQUEST_TYPE_VENDOR,
+	    REGS_REQUEST, REGS_ADDRESS(reg), 0, count * 2);
+    uint8_t *data = buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    for (int i = 0; i < count; i++) {
+	data[i * 2] = regs->values[reg + i] >> 8;
+	data[i * 2 + 1] = regs->values[reg + i];
+    }
+    libusb_fill_control_transfer(transfer, regs->handle, buffer,
+	    regs_callback, regs, 0);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER
+	| LIBUSB_TRANSFER_FREE_TRANSFER;
+    int r = libusb_submit_transfer(transfer);
+    if (r) {
+	libusb_free_transfer(transfer);
+	if (!regs->status)
+	    regs->status = r;
+    } else
+	regs->pending++;
+}
+
+int
+regs_flush(struct regs *regs)
+{
+    /* Submit one transfer for each run of consecutive registers. */
+    int reg = 0;
+    while (regs->dirty) {
+	while (!(regs->dirty & ((uint64_t) 1 << reg)))
+	    reg++;
+	int count = 0;
+	while (regs->dirty & ((uint64_t) 1 << (reg + count))) {
+	    regs->dirty &= ~((uint64_t) 1 << (reg + count));
+	    count++;
+	}
+	regs_submit(regs, reg, count);
+	reg += count;
+    }
+    /* Wait for all of them. */
+    regs->done = !regs->pending;
+    while (!regs->done) {
+	int r = libusb_handle_events_completed(regs->usb, &regs->done);
+	if (r && r != LIBUSB_ERROR_INTERRUPTED)
+	    error(EXIT_FAILURE, 0, "can not handle events: %s",
+		    libusb_strerror(r));
+    }
+    int r = regs->status;
+    if (r) {
+	/* Some writes may not have reached the device. */
+	regs->status = 0;
+	regs_invalidate(regs);
+    }
+    return r;
+}
@@ -0,0 +1,82 @@
+#ifndef regs_h
+#define regs_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <libusb.h>
+#include <stdint.h>
+
+/* Number of sensor registers handled, from 0x00 to 0x2e. */
+#define REGS_NB 0x2f
+
+/* Sensor register layer.
+ *
+ * Registers are written through vendor control transfers.  A shadow copy
+ * of each register is kept, so that writes which would not change a value
+ * are skipped.  Other writes are queued until regs_flush, which merges
+ * consecutive registers in a single transfer, using the sensor address
+ * auto-increment, and submits all transfers back to back.
+ *
+ * Not thread safe, to be used from one thread at a time. */
+struct regs {
+    libusb_context *usb;
+    libusb_device_handle *handle;
+    /* Shadow copy, valid for known registers. */
+    uint16_t values[REGS_NB];
+    /* Bit masks of registers with a known value, and of registers to be
+     * written. */
+    uint64_t known;
+    uint64_t dirty;
+    /* Transfers submitted and not completed yet. */
+    int pending;
+    /* Set when no transfer is pending, used to wait for completion. */
+    int done;
+    /* First error met by a transfer, or 0. */
+    int status;
+};
+
+/* Initialise register layer for a newly opened device, all registers are
+ * unknown. */
+void
+regs_init(struct regs *regs, libusb_context *usb,
+	libusb_device_handle *handle);
+
+/* Queue a register write, unless it already has this value. */
+void
+regs_write(struct regs *regs, int reg, uint16_t value);
+
+/* Queue several consecutive register writes. */
+void
+regs_write_burst(struct regs *regs, int reg, const uint16_t *values,
+	int count);
+
+/* Forget all shadow values, to be used when the device resets its
+ * registers. */
+void
+regs_invalidate(struct regs *regs);
+
+/* Send queued writes and wait until they are done.  Return 0, or the
+ * first libusb error, for example when the device is lost. */
+int
+regs_flush(struct regs *regs);
+
+#endif /* regs_h */
@@ -0,0 +1,219 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+
+struct replay {
+    const uint8_t *data;
+    size_t size;
+    int width;
+    int height;
+    int count;
+    /* Offsets of frames from the file index, or NULL if they are found
+     * from the first one and the distance between frames. */
+    const uint64_t *index;
+    size_t first;
+    size_t stride;
+    /* Size of frame headers, 0 for bare images. */
+    size_t frame_header_size;
+};
+
+/* Return the trailer of a complete container file, or NULL. */
+static const struct rawfile_trailer *
+replay_trailer(struct replay *replay)
+{
+    const struct rawfile_trailer *trailer;
+    if (replay->size % 8 || replay->size < replay->first + sizeof(*trailer))
+	return NULL;
+    trailer = (const void *) (replay->data + replay->size - sizeof(*trailer));
+    if (memcmp(trailer->magic, RAWFILE_INDEX_MAGIC, sizeof(trailer->magic))
+	    || trailer->index_offset % 8
+	    || trailer->index_offset > replay->size - sizeof(*trailer)
+	    || trailer->count > INT_MAX
+	    || trailer->count > (replay->size - sizeof(*trailer)
+		- trailer->index_offset) / sizeof(uint64_t))
+	return NULL;
+    return trailer;
+}
+
+/* Find frames of a container file. */
+static void
+replay_open_container(struct replay *replay, const char *name)
+{
+    const struct rawfile_header *header = (const void *) replay->data;
+    if (header->version != RAWFILE_VERSION)
+	error(EXIT_FAILURE, 0, "replay file `%s' has unsupported version %u",
+		name, header->version);
+    if (memcmp(header->cfa, "GRBG", 4))
+	error(EXIT_FAILURE, 0, "replay file `%s' has unsupported pattern",
+		name);
+    if (header->frame_header_size < sizeof(struct rawfile_frame)
+	    || header->frame_header_size % 8)
+	error(EXIT_FAILURE, 0, "replay file `%s' has bad frame headers",
+		name);
+    /* Only sizes produced by the camera, the rest of the program is
+     * sized from them. */
+    static const struct { uint32_t width, height; } sizes[] = {
+	{ 512, 384 }, { 1024, 768 }, { 2048, 1536 },
+    };
+    size_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	if (header->width == sizes[i].width
+		&& header->height == sizes[i].height)
+	    break;
+    }
+    if (i == sizeof(sizes) / sizeof(sizes[0]))
+	error(EXIT_FAILURE, 0, "replay file `%s' has unsupported size %ux%u",
+		name, header->width, header->height);
+    replay->width = header->width;
+    replay->height = header->height;
+    replay->frame_header_size = header->frame_header_size;
+    replay->first = sizeof(*header);
+    replay->stride = RAWFILE_ALIGN(replay->frame_header_size
+	    + (size_t) replay->width * replay->height);
+    const struct rawfile_trailer *trailer = replay_trailer(replay);
+    if (trailer) {
+	replay->index = (const uint64_t *) (replay->data
+		+ trailer->index_offset);
+	replay->count = trailer->count;
+	for (int i = 0; i < replay->count; i++) {
+	    uint64_t offset = replay->index[i];
+	    if (offset < replay->first || offset % 8
+		    || offset > trailer->index_offset
+		    || trailer->index_offset - offset < replay->stride)
+		error(EXIT_FAILURE, 0, "replay file `%s' has a bad index",
+			name);
+	}
+    } else {
+	/* Recording was interrupted, frames are still one after the
+	 * other. */
+	error(0, 0, "replay file `%s' has no index, frames are counted",
+		name);
+	size_t count = (replay->size - replay->first) / replay->stride;
+	if (count > INT_MAX)
+	    error(EXIT_FAILURE, 0, "replay file `%s' is too large", name);
+	replay->count = count;
+    }
+}
+
+struct replay *
+replay_open(const char *name, int width, int height)
+{
+    struct replay *replay = malloc(sizeof(*replay));
+    if (!replay)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+	error(EXIT_FAILURE, errno, "can not open replay file `%s'", name);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+	error(EXIT_FAILURE, errno, "can not stat replay file `%s'", name);
+    replay->size = st.st_size;
+    if (!replay->size)
+	error(EXIT_FAILURE, 0, "replay file `%s' is empty", name);
+    replay->data = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (replay->data == MAP_FAILED)
+	error(EXIT_FAILURE, errno, "can not map replay file `%s'", name);
+    close(fd);
+    replay->index = NULL;
+    if (replay->size >= sizeof(struct rawfile_header)
+	    && !memcmp(replay->data, RAWFILE_MAGIC, sizeof(RAWFILE_MAGIC))) {
+	replay_open_container(replay, name);
+    } else {
+	replay->width = width;
+	replay->height = height;
+	replay->frame_header_size = 0;
+	replay->first = 0;
+	replay->stride = (size_t) width * height;
+	if (replay->size / replay->stride > INT_MAX)
+	    error(EXIT_FAILURE, 0, "replay file `%s' is too large", name);
+	replay->count = replay->size / replay->stride;
+	if (replay->size % replay->stride)
+	    error(0, 0, "replay file `%s' has a partial image, ignored",
+		    name);
+    }
+    if (!replay->count)
+	error(EXIT_FAILURE, 0, "replay file `%s' has no complete image",
+		name);
+    madvise((void *) replay->data, replay->size, MADV_SEQUENTIAL);
+    return replay;
+}
+
+void
+replay_close(struct replay *replay)
+{
+    munmap((void *) replay->data, replay->size);
+    free(replay);
+}
+
+int
+replay_width(struct replay *replay)
+{
+    return replay->width;
+}
+
+int
+replay_height(struct replay *replay)
+{
+    return replay->height;
+}
+
+int
+replay_count(struct replay *replay)
+{
+    return replay->count;
+}
+
+/* Return offset of a frame header, or of an image for bare files. */
+static size_t
+replay_offset(struct replay *replay, int index)
+{
+    return replay->index ? replay->index[index]
+	: replay->first + (size_t) index * replay->stride;
+}
+
+const uint8_t *
+replay_image(struct replay *replay, int index)
+{
+    return replay->data + replay_offset(replay, index)
+	+ replay->frame_header_size;
+}
+
+const struct rawfile_frame *
+replay_frame(struct replay *replay, int index)
+{
+    if (!replay->frame_header_size)
+	return NULL;
+    return (const void *) (replay->data + replay_offset(replay, index));
+}
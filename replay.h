@@ -0,0 +1,61 @@
+#ifndef replay_h
+#define replay_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdint.h>
+
+#include "rawfile.h"
+
+/* Recorded raw file, used as a virtual camera. */
+struct replay;
+
+/* Map a raw file, either a container giving its own image size, or bare
+ * images of the given size. */
+struct replay *
+replay_open(const char *name, int width, int height);
+
+/* Unmap file. */
+void
+replay_close(struct replay *replay);
+
+/* Return the image size. */
+int
+replay_width(struct replay *replay);
+
+int
+replay_height(struct replay *replay);
+
+/* Return the number of images in file. */
+int
+replay_count(struct replay *replay);
+
+/* Return the image data at the given index. */
+const uint8_t *
+replay_image(struct replay *replay, int index);
+
+/* Return the recorded information of the image at the given index, or
+ * NULL for bare images. */
+const struct rawfile_frame *
+replay_frame(struct replay *replay, int index);
+
+#endif /* replay_h */
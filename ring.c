@@ -0,0 +1,83 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <error.h>
+
+#include "ring.h"
+
+/* Head and tail are free running counters, the index in the items array
+ * is taken modulo the ring size.  The allocated size is rounded up to a
+ * power of two so that this stays true when counters wrap. */
+
+void
+ring_init(struct ring *ring, int size)
+{
+    ring->size = 1;
+    while (ring->size < size)
+	ring->size <<= 1;
+    ring->items = calloc(ring->size, sizeof(*ring->items));
+    if (!ring->items)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+void
+ring_uninit(struct ring *ring)
+{
+    free(ring->items);
+    ring->items = NULL;
+}
+
+bool
+ring_push(struct ring *ring, void *item)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == (unsigned) ring->size)
+	return false;
+    ring->items[tail % ring->size] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *
+ring_pop(struct ring *ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail)
+	return NULL;
+    void *item = ring->items[head % ring->size];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return item;
+}
+
+int
+ring_count(struct ring *ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail - head;
+}
@@ -0,0 +1,60 @@
+#ifndef ring_h
+#define ring_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Bounded lock-free ring of pointers, for exactly one producer thread and
+ * one consumer thread. */
+struct ring {
+    int size;
+    void **items;
+    /* Only written by the consumer. */
+    atomic_uint head;
+    /* Only written by the producer. */
+    atomic_uint tail;
+};
+
+/* Allocate a ring which can hold at least size items. */
+void
+ring_init(struct ring *ring, int size);
+
+/* Release ring memory. */
+void
+ring_uninit(struct ring *ring);
+
+/* Push an item, return false if the ring is full.  Producer only. */
+bool
+ring_push(struct ring *ring, void *item);
+
+/* Pop an item, return NULL if the ring is empty.  Consumer only. */
+void *
+ring_pop(struct ring *ring);
+
+/* Return the number of items in the ring, exact only when called from the
+ * producer or the consumer thread. */
+int
+ring_count(struct ring *ring);
+
+#endif /* ring_h */
@@ -0,0 +1,155 @@
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <error.h>
+#include <pthread.h>
+
+#include "workers.h"
+
+struct workers_thread {
+    struct workers *workers;
+    int index;
+    pthread_t thread;
+};
+
+struct workers {
+    int count;
+    struct workers_thread *threads;
+    /* Only one job at a time. */
+    pthread_mutex_t run_mutex;
+    /* Protect the following fields. */
+    pthread_mutex_t mutex;
+    /* Signaled when a job is posted. */
+    pthread_cond_t start_cond;
+    /* Signaled when the last part is done. */
+    pthread_cond_t done_cond;
+    /* Incremented for each job, so that workers see new jobs. */
+    unsigned generation;
+    workers_fn fn;
+    void *arg;
+    /* Number of parts still running in threads. */
+    int pending;
+    bool quit;
+};
+
+static void *
+workers_thread(void *arg)
+{
+    struct workers_thread *thread = arg;
+    struct workers *workers = thread->workers;
+    unsigned generation = 0;
+    pthread_mutex_lock(&workers->mutex);
+    while (1) {
+	while (!workers->quit && workers->generation == generation)
+	    pthread_cond_wait(&workers->start_cond, &workers->mutex);
+	if (workers->quit)
+	    break;
+	generation = workers->generation;
+	workers_fn fn = workers->fn;
+	void *fn_arg = workers->arg;
+	pthread_mutex_unlock(&workers->mutex);
+	fn(fn_arg, thread->index, workers->count);
+	pthread_mutex_lock(&workers->mutex);
+	if (--workers->pending == 0)
+	    pthread_cond_signal(&workers->done_cond);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+    return NULL;
+}
+
+struct workers *
+workers_new(int count)
+{
+    struct workers *workers = malloc(sizeof(*workers));
+    if (!workers)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    workers->count = count;
+    workers->threads = calloc(count, sizeof(*workers->threads));
+    if (!workers->threads)
+	error(EXIT_FAILURE, 0, "memory exhausted");
+    pthread_mutex_init(&workers->run_mutex, NULL);
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->start_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+    workers->generation = 0;
+    workers->pending = 0;
+    workers->quit = false;
+    /* Part 0 is run by the caller. */
+    for (int i = 1; i < count; i++) {
+	struct workers_thread *thread = &workers->threads[i];
+	thread->workers = workers;
+	thread->index = i;
+	int r = pthread_create(&thread->thread, NULL, workers_thread, thread);
+	if (r)
+	    error(EXIT_FAILURE, r, "can not create worker thread");
+    }
+    return workers;
+}
+
+void
+workers_free(struct workers *workers)
+{
+    pthread_mutex_lock(&workers->mutex);
+    workers->quit = true;
+    pthread_cond_broadcast(&workers->start_cond);
+    pthread_mutex_unlock(&workers->mutex);
+    for (int i = 1; i < workers->count; i++)
+	pthread_join(workers->threads[i].thread, NULL);
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->start_cond);
+    pthread_mutex_destroy(&workers->mutex);
+    pthread_mutex_destroy(&workers->run_mutex);
+    free(workers->threads);
+    free(workers);
+}
+
+int
+workers_count(struct workers *workers)
+{
+    return workers->count;
+}
+
+void
+workers_run(struct workers *workers, workers_fn fn, void *arg)
+{
+    pthread_mutex_lock(&workers->run_mutex);
+    if (workers->count > 1) {
+	pthread_mutex_lock(&workers->mutex);
+	workers->fn = fn;
+	workers->arg = arg;
+	workers->pending = workers->count - 1;
+	workers->generation++;
+	pthread_cond_broadcast(&workers->start_cond);
+	pthread_mutex_unlock(&workers->mutex);
+    }
+    fn(arg, 0, workers->count);
+    if (workers->count > 1) {
+	pthread_mutex_lock(&workers->mutex);
+	while (workers->pending)
+	    pthread_cond_wait(&workers->done_cond, &workers->mutex);
+	pthread_mutex_unlock(&workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->run_mutex);
+}
@@ -0,0 +1,53 @@
+#ifndef workers_h
+#define workers_h
+/* Moticam 3+ viewer.
+ *
+ * Copyright (C) 2019 Nicolas Schodet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Contact :
+ *        Web: http://ni.fr.eu.org/
+ *      Email: <nico at ni.fr.eu.org>
+ */
+
+/* Pool of persistent worker threads.
+ *
+ * A job is split in a fixed number of parts, run in parallel by the
+ * workers and by the calling thread.  Threads are kept between jobs, so
+ * that the cost of a job is only a wake up. */
+struct workers;
+
+/* Function run for each part of a job, index is from 0 to count - 1. */
+typedef void (*workers_fn)(void *arg, int index, int count);
+
+/* Create a pool to split jobs in count parts, with count - 1 threads. */
+struct workers *
+workers_new(int count);
+
+/* Stop threads and release pool. */
+void
+workers_free(struct workers *workers);
+
+/* Return the number of parts of a job. */
+int
+workers_count(struct workers *workers);
+
+/* Run a job and wait until all its parts are done.  Can be called from
+ * several threads, jobs are run one after the other. */
+void
+workers_run(struct workers *workers, workers_fn fn, void *arg);
+
+#endif /* workers_h */